@@ -24,6 +24,12 @@
 
 #define ext2_in_range(b, first, len)	((b) >= (first) && (b) <= (first) + (len) - 1)
 
+/*
+ * How many blocks past the goal to look for a free run of the requested
+ * length, before looking at the rest of the block group.
+ */
+#define EXT2_ALLOC_WINDOW 2048
+
 /**
  * Check whether the block_bitmap of the given block block_group is valid.
  * A valid block_bitmap satisfies the following:
@@ -302,47 +308,100 @@ void ext2_free_blocks(struct inode *inode, unsigned long block, unsigned long co
 }
 
 /*
- * Finds the first free block in bitmap_bh and allocates up to count
- * consecutive blocks.
- * Returns the group offset of the first allocated block and the number of
- * blocks it managed to allocate (using the count parameter).
+ * Looks for a free run of blocks in the group offsets [start, end) of bitmap.
+ * Best fit: returns the start of the shortest run of at least *count blocks
+ * or, if there is none, of the longest run found, and sets *count to the
+ * usable length of the run. Returns -1 if there are no free blocks at all.
  */
-/* ? */
-/* You can use find_next_zero_bit_le() and ext2_set_bit_atomic() functions to 
- * handle the bitmaps.
+static ext2_grpblk_t ext2_find_free_run(char *bitmap, ext2_grpblk_t start,
+                                        ext2_grpblk_t end, unsigned long *count)
+{
+	ext2_grpblk_t here, next, best = -1;
+	unsigned long len, best_len = 0;
+	unsigned long want = *count;
+
+	here = find_next_zero_bit_le(bitmap, end, start);
+	while (here < end) {
+		next = find_next_bit_le(bitmap, end, here);
+		len = next - here;
+		if (len >= want ? (best_len < want || len < best_len) : len > best_len) {
+			best = here;
+			best_len = len;
+			if (len == want)
+				break; /* Can't do better than a perfect fit */
+		}
+		here = find_next_zero_bit_le(bitmap, end, next);
+	}
+
+	if (best < 0)
+		return -1;
+	*count = min(best_len, want);
+	return best;
+}
+
+/*
+ * Allocates up to count consecutive blocks from the group, as close to
+ * grp_goal as possible (a negative grp_goal means no preference):
+ *  1. At grp_goal itself, if it is free, so that a file grows in place.
+ *  2. At the best fitting free run in the window following grp_goal.
+ *  3. At the best fitting free run in the whole group, if the window has
+ *     no run long enough.
+ * Returns the group offset of the first allocated block and the number of
+ * blocks it managed to allocate (using the count parameter), or -1 if the
+ * group is full.
  */
 static int ext2_allocate_in_bg(struct super_block *sb, int group,
-                               struct buffer_head *bitmap_bh, unsigned long *count)
+                               struct buffer_head *bitmap_bh,
+                               ext2_grpblk_t grp_goal, unsigned long *count)
 {
 	ext2_fsblk_t group_first_block = ext2_group_first_block_no(sb, group);
 	ext2_fsblk_t group_last_block = ext2_group_last_block_no(sb, group);
 	ext2_grpblk_t nblocks = group_last_block - group_first_block + 1;
-	ext2_grpblk_t first_free_bit;
-	unsigned long num = 0 ;
+	ext2_grpblk_t start, start_any, end;
+	unsigned long num, len, len_any;
+
+	if (grp_goal < 0 || grp_goal >= nblocks)
+		grp_goal = 0;
+
+	do {
+		if (!test_bit_le(grp_goal, bitmap_bh->b_data)) {
+			start = grp_goal;
+		} else {
+			len = *count;
+			end = min_t(ext2_grpblk_t, nblocks, grp_goal + EXT2_ALLOC_WINDOW);
+			start = ext2_find_free_run(bitmap_bh->b_data, grp_goal, end, &len);
+			if (start < 0 || len < *count) {
+				len_any = *count;
+				start_any = ext2_find_free_run(bitmap_bh->b_data, 0, nblocks,
+				                               &len_any);
+				if (start_any < 0)
+					return -1;
+				if (start < 0 || len_any > len)
+					start = start_any;
+			}
+		}
 
-	/* ? */
-	first_free_bit = find_next_zero_bit_le(bitmap_bh->b_data, nblocks, 0);
-	if (first_free_bit >= nblocks)
-		return -1;
+		/* Claim the run, it may shrink under a concurrent allocation */
+		num = 0;
+		while (num < *count && (start + num) < nblocks &&
+		       !ext2_set_bit_atomic(sb_bgl_lock(EXT2_SB(sb), group),
+		                            start + num, bitmap_bh->b_data))
+			num++;
+	} while (num == 0);
 
-	while (num < *count && (first_free_bit + num) < nblocks &&
-	       !ext2_set_bit_atomic(sb_bgl_lock(EXT2_SB(sb), group), 
-                               first_free_bit + num, bitmap_bh->b_data)) {
-		num++;
-	}
-	if (num == 0) return -1;
 	*count = num;
-	return first_free_bit;
-	//return -1;
+	return start;
 }
 
 /*
  * Allocates from disk a new block and returns its number on the disk.
  * `*countp` is used both as input and as output. As input it is the max blocks
  * that we are allowed to allocate. As output it show how many blocks we really
- * allocated.
+ * allocated. The blocks are allocated as close to `goal` as possible; a goal
+ * of 0 means anywhere, starting with the inode's block group.
  */
-ext2_fsblk_t ext2_new_blocks(struct inode *inode, unsigned long *countp, int *errp)
+ext2_fsblk_t ext2_new_blocks(struct inode *inode, ext2_fsblk_t goal,
+                             unsigned long *countp, int *errp)
 {
 	struct buffer_head *bitmap_bh = NULL, *gdp_bh;
 	struct super_block *sb = inode->i_sb;
@@ -354,6 +413,7 @@ ext2_fsblk_t ext2_new_blocks(struct inode *inode, unsigned long *countp, int *er
 	int bgi;
 	__u16 free_blocks;
 	__u32 group_no = ei->i_block_group;
+	ext2_grpblk_t grp_goal = -1;  /* blockgroup-relative goal block */
 	ext2_grpblk_t grp_alloc_blk;  /* blockgroup-relative allocated block*/
 	ext2_fsblk_t ret_block;       /* filesystem-wide allocated block */
 
@@ -367,9 +427,22 @@ ext2_fsblk_t ext2_new_blocks(struct inode *inode, unsigned long *countp, int *er
 	}
 
 	/*
-	 * Now search each of the groups starting from the inode's group.
+	 * Start from the group of the goal block, if there is one.
 	 */
-	for (bgi = 0; bgi < ngroups; bgi++, group_no = (group_no + 1) % ngroups) {
+	if (goal > le32_to_cpu(sbi->s_es->s_first_data_block) &&
+	    goal < le32_to_cpu(sbi->s_es->s_blocks_count)) {
+		group_no = (goal - le32_to_cpu(sbi->s_es->s_first_data_block)) /
+		           EXT2_BLOCKS_PER_GROUP(sb);
+		grp_goal = (goal - le32_to_cpu(sbi->s_es->s_first_data_block)) %
+		           EXT2_BLOCKS_PER_GROUP(sb);
+	}
+
+	/*
+	 * Now search each of the groups starting from the goal's group.
+	 * Only the first group has a goal within it.
+	 */
+	for (bgi = 0; bgi < ngroups;
+	     bgi++, group_no = (group_no + 1) % ngroups, grp_goal = -1) {
 		gdp = ext2_get_group_desc(sb, group_no, &gdp_bh);
 		if (!gdp) {
 			*errp = -EIO;
@@ -389,7 +462,7 @@ ext2_fsblk_t ext2_new_blocks(struct inode *inode, unsigned long *countp, int *er
 		}
 
 		//> try to allocate block(s) from this group.
-		grp_alloc_blk = ext2_allocate_in_bg(sb, group_no, bitmap_bh, &count);
+		grp_alloc_blk = ext2_allocate_in_bg(sb, group_no, bitmap_bh, grp_goal, &count);
 		if (grp_alloc_blk < 0)
 			continue;
 
@@ -416,6 +489,7 @@ ext2_fsblk_t ext2_new_blocks(struct inode *inode, unsigned long *countp, int *er
 	}
 
 	//> No space left on the device.
+	brelse(bitmap_bh);
 	*errp = -ENOSPC;
 	return 0;
 }
@@ -10,6 +10,8 @@
 
 #include <linux/buffer_head.h>
 #include <linux/iversion.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
 #include "ext2.h"
 
 /*
@@ -51,6 +53,11 @@ static void ext2_commit_chunk(struct folio *folio, loff_t pos, unsigned len)
 	folio_unlock(folio);
 }
 
+static int ext2_prepare_chunk(struct folio *folio, loff_t pos, unsigned len)
+{
+	return __block_write_begin(&folio->page, pos, len, ext2_get_block);
+}
+
 static bool ext2_check_folio(struct folio *folio, int quiet, char *kaddr)
 {
 	struct inode *dir = folio->mapping->host;
@@ -240,6 +247,528 @@ static int ext2_readdir(struct file *file, struct dir_context *ctx)
 	return 0;
 }
 
+/*
+ * Hashed directory index (htree), in the on-disk format of ext3.
+ *
+ * Block 0 of an indexed directory holds "." and "..", with ".." spanning
+ * the rest of the block, and the root of the index hidden in the space
+ * that ".." claims. Index nodes are blocks holding a single empty entry
+ * that spans them. Everyone that scans the directory linearly sees a
+ * valid, if sparse, directory, while we hash the name and descend at most
+ * two levels of (hash, block) entries to the one leaf block that can hold
+ * it. Leaves are plain directory blocks; when one fills up, its upper half
+ * by hash moves to a new block at the end of the directory.
+ */
+#define DX_HASH_LEGACY		0
+#define DX_HASH_HALF_MD4	1
+#define DX_HASH_TEA		2
+
+#define DX_MAX_LEVELS		2	/* the root and one level of nodes */
+
+/* The s_flags of ext3 sit in what ext2.h still calls s_reserved. */
+#define EXT2_SB_FLAGS(es)		le32_to_cpu((es)->s_reserved[22])
+#define EXT2_FLAGS_UNSIGNED_HASH	0x0002
+
+/* Returned when the index can not be trusted; the callers go linear. */
+#define ERR_BAD_DX_DIR		(-(MAX_ERRNO - 1))
+
+struct fake_dirent {
+	__le32 inode;
+	__le16 rec_len;
+	u8 name_len;
+	u8 file_type;
+};
+
+struct dx_countlimit {
+	__le16 limit;
+	__le16 count;
+};
+
+/* The first entry of each node overlays its count and limit on the hash. */
+struct dx_entry {
+	__le32 hash;
+	__le32 block;
+};
+
+struct dx_root {
+	struct fake_dirent dot;
+	char dot_name[4];
+	struct fake_dirent dotdot;
+	char dotdot_name[4];
+	struct dx_root_info {
+		__le32 reserved_zero;
+		u8 hash_version;
+		u8 info_length;		/* 8 */
+		u8 indirect_levels;
+		u8 unused_flags;
+	} info;
+	struct dx_entry entries[];
+};
+
+struct dx_node {
+	struct fake_dirent fake;
+	struct dx_entry entries[];
+};
+
+/*
+ * Where the lookup of a hash went through one node of the index: at is the
+ * entry that covers the hash and next the block that entry points to.
+ */
+struct dx_frame {
+	unsigned long block;
+	unsigned offs;
+	unsigned at;
+	unsigned count;
+	unsigned limit;
+	u32 next;
+};
+
+struct dx_hash_info {
+	u32 hash;
+	int hash_version;
+};
+
+struct dx_map_entry {
+	u32 hash;
+	u16 offs;
+	u16 size;
+};
+
+static inline unsigned dx_get_count(struct dx_entry *entries)
+{
+	return le16_to_cpu(((struct dx_countlimit *)entries)->count);
+}
+
+static inline unsigned dx_get_limit(struct dx_entry *entries)
+{
+	return le16_to_cpu(((struct dx_countlimit *)entries)->limit);
+}
+
+static inline void dx_set_count(struct dx_entry *entries, unsigned count)
+{
+	((struct dx_countlimit *)entries)->count = cpu_to_le16(count);
+}
+
+static inline void dx_set_limit(struct dx_entry *entries, unsigned limit)
+{
+	((struct dx_countlimit *)entries)->limit = cpu_to_le16(limit);
+}
+
+static inline u32 dx_get_hash(struct dx_entry *entry)
+{
+	return le32_to_cpu(entry->hash);
+}
+
+static inline u32 dx_get_block(struct dx_entry *entry)
+{
+	return le32_to_cpu(entry->block) & 0x00ffffff;
+}
+
+static inline unsigned dx_root_limit(struct inode *dir)
+{
+	return (ext2_chunk_size(dir) - offsetof(struct dx_root, entries)) /
+	       sizeof(struct dx_entry);
+}
+
+static inline unsigned dx_node_limit(struct inode *dir)
+{
+	return (ext2_chunk_size(dir) - EXT2_DIR_REC_LEN(0)) / sizeof(struct dx_entry);
+}
+
+static inline int ext2_has_dir_index(struct super_block *sb)
+{
+	return !!(EXT2_SB(sb)->s_es->s_feature_compat &
+	          cpu_to_le32(EXT2_FEATURE_COMPAT_DIR_INDEX));
+}
+
+static inline int ext2_is_dx(struct inode *dir)
+{
+	return ext2_has_dir_index(dir->i_sb) &&
+	       (EXT2_I(dir)->i_flags & EXT2_INDEX_FL);
+}
+
+/*
+ * The hash functions of ext3, so that the index stays readable by e2fsck
+ * and by ext3/ext4. The sign of char is part of the hash; the superblock
+ * says which one the filesystem was created with.
+ */
+static inline int dx_char(const char *p, int unsigned_char)
+{
+	return unsigned_char ? (int)(unsigned char)*p : (int)(signed char)*p;
+}
+
+static u32 dx_hack_hash(const char *name, int len, int unsigned_char)
+{
+	u32 hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+
+	while (len--) {
+		hash = hash1 + (hash0 ^ (dx_char(name++, unsigned_char) * 7152373));
+		if (hash & 0x80000000)
+			hash -= 0x7fffffff;
+		hash1 = hash0;
+		hash0 = hash;
+	}
+	return hash0 << 1;
+}
+
+static void dx_str2hashbuf(const char *msg, int len, u32 *buf, int num,
+                           int unsigned_char)
+{
+	u32 pad, val;
+	int i;
+
+	pad = (u32)len | ((u32)len << 8);
+	pad |= pad << 16;
+
+	val = pad;
+	if (len > num * 4)
+		len = num * 4;
+	for (i = 0; i < len; i++) {
+		val = dx_char(msg + i, unsigned_char) + (val << 8);
+		if ((i % 4) == 3) {
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+	if (--num >= 0)
+		*buf++ = val;
+	while (--num >= 0)
+		*buf++ = pad;
+}
+
+static void dx_tea_transform(u32 buf[4], const u32 in[4])
+{
+	u32 sum = 0;
+	u32 b0 = buf[0], b1 = buf[1];
+	u32 a = in[0], b = in[1], c = in[2], d = in[3];
+	int n = 16;
+
+	do {
+		sum += 0x9E3779B9;
+		b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+		b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+	} while (--n);
+
+	buf[0] += b0;
+	buf[1] += b1;
+}
+
+#define DX_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define DX_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define DX_H(x, y, z) ((x) ^ (y) ^ (z))
+#define DX_ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + x, a = rol32(a, s))
+#define DX_K1 0
+#define DX_K2 013240474631UL
+#define DX_K3 015666365641UL
+
+static void dx_half_md4_transform(u32 buf[4], const u32 in[8])
+{
+	u32 a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	DX_ROUND(DX_F, a, b, c, d, in[0] + DX_K1,  3);
+	DX_ROUND(DX_F, d, a, b, c, in[1] + DX_K1,  7);
+	DX_ROUND(DX_F, c, d, a, b, in[2] + DX_K1, 11);
+	DX_ROUND(DX_F, b, c, d, a, in[3] + DX_K1, 19);
+	DX_ROUND(DX_F, a, b, c, d, in[4] + DX_K1,  3);
+	DX_ROUND(DX_F, d, a, b, c, in[5] + DX_K1,  7);
+	DX_ROUND(DX_F, c, d, a, b, in[6] + DX_K1, 11);
+	DX_ROUND(DX_F, b, c, d, a, in[7] + DX_K1, 19);
+
+	DX_ROUND(DX_G, a, b, c, d, in[1] + DX_K2,  3);
+	DX_ROUND(DX_G, d, a, b, c, in[3] + DX_K2,  5);
+	DX_ROUND(DX_G, c, d, a, b, in[5] + DX_K2,  9);
+	DX_ROUND(DX_G, b, c, d, a, in[7] + DX_K2, 13);
+	DX_ROUND(DX_G, a, b, c, d, in[0] + DX_K2,  3);
+	DX_ROUND(DX_G, d, a, b, c, in[2] + DX_K2,  5);
+	DX_ROUND(DX_G, c, d, a, b, in[4] + DX_K2,  9);
+	DX_ROUND(DX_G, b, c, d, a, in[6] + DX_K2, 13);
+
+	DX_ROUND(DX_H, a, b, c, d, in[3] + DX_K3,  3);
+	DX_ROUND(DX_H, d, a, b, c, in[7] + DX_K3,  9);
+	DX_ROUND(DX_H, c, d, a, b, in[2] + DX_K3, 11);
+	DX_ROUND(DX_H, b, c, d, a, in[6] + DX_K3, 15);
+	DX_ROUND(DX_H, a, b, c, d, in[1] + DX_K3,  3);
+	DX_ROUND(DX_H, d, a, b, c, in[5] + DX_K3,  9);
+	DX_ROUND(DX_H, c, d, a, b, in[0] + DX_K3, 11);
+	DX_ROUND(DX_H, b, c, d, a, in[4] + DX_K3, 15);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+static u32 ext2_dx_hash(struct inode *dir, int hash_version,
+                        const char *name, int len)
+{
+	struct ext2_super_block *es = EXT2_SB(dir->i_sb)->s_es;
+	int unsigned_char = !!(EXT2_SB_FLAGS(es) & EXT2_FLAGS_UNSIGNED_HASH);
+	u32 buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	u32 in[8], hash;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		if (es->s_hash_seed[i]) {
+			for (i = 0; i < 4; i++)
+				buf[i] = le32_to_cpu(es->s_hash_seed[i]);
+			break;
+		}
+	}
+
+	switch (hash_version) {
+	case DX_HASH_LEGACY:
+		hash = dx_hack_hash(name, len, unsigned_char);
+		break;
+	case DX_HASH_HALF_MD4:
+		for ( ; len > 0; len -= 32, name += 32) {
+			dx_str2hashbuf(name, len, in, 8, unsigned_char);
+			dx_half_md4_transform(buf, in);
+		}
+		hash = buf[1];
+		break;
+	default:
+		for ( ; len > 0; len -= 16, name += 16) {
+			dx_str2hashbuf(name, len, in, 4, unsigned_char);
+			dx_tea_transform(buf, in);
+		}
+		hash = buf[0];
+		break;
+	}
+
+	//> The low bit of the hashes in the index marks hash collisions, and
+	//> ext3 keeps the last even hash for the end of the directory.
+	hash &= ~1;
+	if (hash == 0xfffffffe)
+		hash = 0xfffffffc;
+	return hash;
+}
+
+/* Returns the address of block `block' of dir, in a mapped folio. */
+static char *ext2_dx_get_chunk(struct inode *dir, unsigned long block,
+                               struct folio **foliop)
+{
+	unsigned bits = PAGE_SHIFT - dir->i_blkbits;
+	char *kaddr = ext2_get_folio(dir, block >> bits, 0, foliop);
+
+	if (IS_ERR(kaddr))
+		return kaddr;
+	return kaddr + ((block & ((1UL << bits) - 1)) << dir->i_blkbits);
+}
+
+/*
+ * Same, with the folio locked and the block ready to be (re)written,
+ * allocating it if it lies at the end of the directory.
+ * ext2_dx_end_chunk() commits it.
+ */
+static char *ext2_dx_begin_chunk(struct inode *dir, unsigned long block,
+                                 struct folio **foliop)
+{
+	char *kaddr = ext2_dx_get_chunk(dir, block, foliop);
+	int err;
+
+	if (IS_ERR(kaddr))
+		return kaddr;
+
+	folio_lock(*foliop);
+	err = ext2_prepare_chunk(*foliop, (loff_t)block << dir->i_blkbits,
+	                         ext2_chunk_size(dir));
+	if (err) {
+		folio_unlock(*foliop);
+		folio_release_kmap(*foliop, kaddr);
+		return ERR_PTR(err);
+	}
+	return kaddr;
+}
+
+static void ext2_dx_end_chunk(struct inode *dir, unsigned long block,
+                              struct folio *folio, char *kaddr)
+{
+	ext2_commit_chunk(folio, (loff_t)block << dir->i_blkbits,
+	                  ext2_chunk_size(dir));
+	folio_release_kmap(folio, kaddr);
+}
+
+/*
+ * Reads the node of the index in frame->block, whose entries start at
+ * frame->offs, and points frame->next at the block below entry frame->at,
+ * or, if search is set, below the entry that covers hash.
+ */
+static int ext2_dx_read_node(struct inode *dir, struct dx_frame *frame,
+                             unsigned limit, u32 hash, bool search)
+{
+	unsigned long nblocks = dir->i_size >> dir->i_blkbits;
+	struct dx_entry *entries, *p, *q, *m;
+	struct folio *folio;
+	char *kaddr;
+
+	kaddr = ext2_dx_get_chunk(dir, frame->block, &folio);
+	if (IS_ERR(kaddr))
+		return PTR_ERR(kaddr);
+
+	entries = (struct dx_entry *)(kaddr + frame->offs);
+	frame->count = dx_get_count(entries);
+	frame->limit = dx_get_limit(entries);
+	if (frame->limit != limit || frame->count == 0 || frame->count > limit)
+		goto bad_node;
+
+	if (search) {
+		p = entries + 1;
+		q = entries + frame->count - 1;
+		while (p <= q) {
+			m = p + (q - p) / 2;
+			if (dx_get_hash(m) > hash)
+				q = m - 1;
+			else
+				p = m + 1;
+		}
+		frame->at = p - 1 - entries;
+	} else if (frame->at >= frame->count) {
+		goto bad_node;
+	}
+	frame->next = dx_get_block(entries + frame->at);
+	folio_release_kmap(folio, kaddr);
+
+	if (frame->next == 0 || frame->next >= nblocks) {
+		ext2_error(dir->i_sb, __func__, "bad block %u in index of directory #%lu",
+		           frame->next, dir->i_ino);
+		return ERR_BAD_DX_DIR;
+	}
+	return 0;
+
+bad_node:
+	folio_release_kmap(folio, kaddr);
+	ext2_error(dir->i_sb, __func__, "bad index node %lu in directory #%lu",
+	           frame->block, dir->i_ino);
+	return ERR_BAD_DX_DIR;
+}
+
+/*
+ * Hashes name and walks the index down to the leaf block that should hold
+ * it, frames[nframes - 1].next. Returns nframes, or ERR_BAD_DX_DIR if the
+ * index is not one we can use.
+ */
+static int ext2_dx_probe(struct inode *dir, const struct qstr *name,
+                         struct dx_hash_info *hinfo, struct dx_frame *frames)
+{
+	struct dx_root *root;
+	struct folio *folio;
+	int levels, i, err;
+
+	root = (struct dx_root *)ext2_dx_get_chunk(dir, 0, &folio);
+	if (IS_ERR(root))
+		return PTR_ERR(root);
+
+	hinfo->hash_version = root->info.hash_version;
+	levels = root->info.indirect_levels;
+	if (root->info.reserved_zero || root->info.info_length != 8 ||
+	    hinfo->hash_version > DX_HASH_TEA || levels >= DX_MAX_LEVELS ||
+	    (root->info.unused_flags & 1)) {
+		folio_release_kmap(folio, root);
+		ext2_error(dir->i_sb, __func__, "unsupported index in directory #%lu",
+		           dir->i_ino);
+		return ERR_BAD_DX_DIR;
+	}
+	folio_release_kmap(folio, root);
+
+	hinfo->hash = ext2_dx_hash(dir, hinfo->hash_version, name->name, name->len);
+
+	frames[0].block = 0;
+	frames[0].offs = offsetof(struct dx_root, entries);
+	err = ext2_dx_read_node(dir, frames, dx_root_limit(dir), hinfo->hash, true);
+	for (i = 1; !err && i <= levels; i++) {
+		frames[i].block = frames[i - 1].next;
+		frames[i].offs = offsetof(struct dx_node, entries);
+		err = ext2_dx_read_node(dir, frames + i, dx_node_limit(dir),
+		                        hinfo->hash, true);
+	}
+	return err ? err : levels + 1;
+}
+
+/*
+ * Moves the frames to the next leaf, if it may still hold names that hash
+ * to hash: that is when the hash was split between two leaves, which the
+ * low bit of the next entry's hash marks. Returns 1 if it moved, else 0.
+ */
+static int ext2_dx_next_block(struct inode *dir, u32 hash,
+                              struct dx_frame *frames, int nframes)
+{
+	struct dx_frame *p = frames + nframes - 1;
+	struct dx_entry *entries;
+	struct folio *folio;
+	char *kaddr;
+	u32 bhash;
+	int err;
+
+	while (p->at + 1 >= p->count) {
+		if (p == frames)
+			return 0;
+		p--;
+	}
+
+	kaddr = ext2_dx_get_chunk(dir, p->block, &folio);
+	if (IS_ERR(kaddr))
+		return PTR_ERR(kaddr);
+	entries = (struct dx_entry *)(kaddr + p->offs);
+	bhash = dx_get_hash(entries + p->at + 1);
+	folio_release_kmap(folio, kaddr);
+	if ((bhash & ~1) != hash)
+		return 0;
+
+	/* Step to the next entry on this level and to the first ones below. */
+	p->at++;
+	err = ext2_dx_read_node(dir, p, p->limit, 0, false);
+	while (!err && ++p < frames + nframes) {
+		p->block = (p - 1)->next;
+		p->at = 0;
+		err = ext2_dx_read_node(dir, p, p->limit, 0, false);
+	}
+	return err ? err : 1;
+}
+
+/*
+ * ext2_find_entry() for indexed directories: only the leaf that the hash
+ * of the name leads to is scanned, along with the leaves that continue
+ * its hash.
+ */
+static ext2_dirent *ext2_dx_find_entry(struct inode *dir, const struct qstr *child,
+                                       struct folio **foliop)
+{
+	struct dx_frame frames[DX_MAX_LEVELS];
+	struct dx_hash_info hinfo;
+	unsigned chunk_size = ext2_chunk_size(dir);
+	ext2_dirent *de;
+	char *kaddr, *limit;
+	int nframes, ret;
+
+	nframes = ext2_dx_probe(dir, child, &hinfo, frames);
+	if (nframes < 0)
+		return ERR_PTR(nframes);
+
+	do {
+		kaddr = ext2_dx_get_chunk(dir, frames[nframes - 1].next, foliop);
+		if (IS_ERR(kaddr))
+			return ERR_CAST(kaddr);
+
+		de = (ext2_dirent *)kaddr;
+		limit = kaddr + chunk_size - EXT2_DIR_REC_LEN(1);
+		while ((char *)de <= limit) {
+			if (de->rec_len == 0) {
+				folio_release_kmap(*foliop, kaddr);
+				return ERR_PTR(-EIO);
+			}
+			if (ext2_match(child->len, child->name, de))
+				return de;
+			de = ext2_next_entry(de);
+		}
+		folio_release_kmap(*foliop, kaddr);
+
+		ret = ext2_dx_next_block(dir, hinfo.hash, frames, nframes);
+	} while (ret == 1);
+
+	return ERR_PTR(ret < 0 ? ret : -ENOENT);
+}
+
 /*
  * finds an entry in the specified directory with the wanted name.
  * It returns a pointer to the folio in which the entry was found (as a
@@ -261,6 +790,12 @@ ext2_dirent *ext2_find_entry(struct inode *dir, const struct qstr *child,
 	if (npages == 0)
 		return ERR_PTR(-ENOENT);
 
+	if (ext2_is_dx(dir)) {
+		de = ext2_dx_find_entry(dir, child, foliop);
+		if (!IS_ERR(de) || PTR_ERR(de) != ERR_BAD_DX_DIR)
+			return de;
+	}
+
 	/* Scan all the pages of the directory to find the requested name. */
 	for (i=0; i < npages; i++) {
 	
@@ -309,11 +844,6 @@ int ext2_inode_by_name(struct inode *dir, const struct qstr *child, ino_t *ino)
 	return 0;
 }
 
-static int ext2_prepare_chunk(struct folio *folio, loff_t pos, unsigned len)
-{
-	return __block_write_begin(&folio->page, pos, len, ext2_get_block);
-}
-
 int ext2_set_link(struct inode *dir, ext2_dirent *de,
 		  struct folio *folio, struct inode *inode, bool update_times)
 {
@@ -340,6 +870,455 @@ int ext2_set_link(struct inode *dir, ext2_dirent *de,
 	return err;
 }
 
+/* Adds (hash, block) to the node of frame, right after frame->at. */
+static int ext2_dx_insert_index(struct inode *dir, struct dx_frame *frame,
+                                u32 hash, u32 block)
+{
+	struct dx_entry *entries, *new;
+	struct folio *folio;
+	unsigned count;
+	char *kaddr;
+
+	kaddr = ext2_dx_begin_chunk(dir, frame->block, &folio);
+	if (IS_ERR(kaddr))
+		return PTR_ERR(kaddr);
+
+	entries = (struct dx_entry *)(kaddr + frame->offs);
+	count = dx_get_count(entries);
+	new = entries + frame->at + 1;
+	memmove(new + 1, new, (char *)(entries + count) - (char *)new);
+	new->hash = cpu_to_le32(hash);
+	new->block = cpu_to_le32(block);
+	dx_set_count(entries, count + 1);
+	frame->count = count + 1;
+
+	ext2_dx_end_chunk(dir, frame->block, folio, kaddr);
+	return 0;
+}
+
+/*
+ * Puts name in de, splitting de if it is in use. The folio is locked and
+ * de has room for the name; the folio is unlocked on return.
+ */
+static int ext2_insert_entry(struct folio *folio, ext2_dirent *de,
+                             const struct qstr *name, struct inode *inode)
+{
+	unsigned short rec_len = le16_to_cpu(de->rec_len);
+	unsigned short name_len = EXT2_DIR_REC_LEN(de->name_len);
+	loff_t pos = folio_pos(folio) + offset_in_folio(folio, de);
+	int err;
+
+	err = ext2_prepare_chunk(folio, pos, rec_len);
+	if (err) {
+		folio_unlock(folio);
+		return err;
+	}
+	if (de->inode) {
+		ext2_dirent *de1 = (ext2_dirent *)((char *) de + name_len);
+		de1->rec_len = cpu_to_le16(rec_len - name_len);
+		de->rec_len = cpu_to_le16(name_len);
+		de = de1;
+	}
+	de->name_len = name->len;
+	memcpy(de->name, name->name, name->len);
+	de->inode = cpu_to_le32(inode->i_ino);
+	de->file_type = 0;
+	ext2_commit_chunk(folio, pos, rec_len);
+	return 0;
+}
+
+/* Adds name to leaf block `block' of an indexed directory, if it fits. */
+static int ext2_dx_add_to_leaf(struct inode *dir, unsigned long block,
+                               const struct qstr *name, struct inode *inode)
+{
+	unsigned reclen = EXT2_DIR_REC_LEN(name->len);
+	unsigned short rec_len, name_len;
+	struct folio *folio;
+	ext2_dirent *de;
+	char *kaddr, *limit;
+	int err;
+
+	kaddr = ext2_dx_get_chunk(dir, block, &folio);
+	if (IS_ERR(kaddr))
+		return PTR_ERR(kaddr);
+	folio_lock(folio);
+
+	de = (ext2_dirent *)kaddr;
+	limit = kaddr + ext2_chunk_size(dir) - reclen;
+	while ((char *)de <= limit) {
+		if (de->rec_len == 0) {
+			ext2_error(dir->i_sb, __func__, "zero-length directory entry");
+			err = -EIO;
+			goto out_unlock;
+		}
+		name_len = EXT2_DIR_REC_LEN(de->name_len);
+		rec_len = le16_to_cpu(de->rec_len);
+		if (!de->inode && rec_len >= reclen)
+			goto got_it;
+		if (rec_len >= name_len + reclen)
+			goto got_it;
+		de = ext2_next_entry(de);
+	}
+	err = -ENOSPC;
+out_unlock:
+	folio_unlock(folio);
+	folio_release_kmap(folio, kaddr);
+	return err;
+
+got_it:
+	err = ext2_insert_entry(folio, de, name, inode);
+	folio_release_kmap(folio, kaddr);
+	return err;
+}
+
+/* Overwrites block `block' of dir with the chunk at from. */
+static int ext2_dx_write_chunk(struct inode *dir, unsigned long block,
+                               const char *from)
+{
+	struct folio *folio;
+	char *kaddr = ext2_dx_begin_chunk(dir, block, &folio);
+
+	if (IS_ERR(kaddr))
+		return PTR_ERR(kaddr);
+	memcpy(kaddr, from, ext2_chunk_size(dir));
+	ext2_dx_end_chunk(dir, block, folio, kaddr);
+	return 0;
+}
+
+/*
+ * Hashes the live entries of the chunk at base, from offset offs on,
+ * into map. Returns how many there are.
+ */
+static unsigned ext2_dx_make_map(struct inode *dir, int hash_version,
+                                 char *base, unsigned offs,
+                                 struct dx_map_entry *map)
+{
+	char *limit = base + ext2_chunk_size(dir) - EXT2_DIR_REC_LEN(1);
+	ext2_dirent *de = (ext2_dirent *)(base + offs);
+	unsigned count = 0;
+
+	for ( ; (char *)de <= limit && de->rec_len; de = ext2_next_entry(de)) {
+		if (!de->inode)
+			continue;
+		map[count].hash = ext2_dx_hash(dir, hash_version, de->name,
+		                               de->name_len);
+		map[count].offs = (char *)de - base;
+		map[count].size = EXT2_DIR_REC_LEN(de->name_len);
+		count++;
+	}
+	return count;
+}
+
+/* Packs the count entries of the chunk at from that map lists into to. */
+static void ext2_dx_pack(struct inode *dir, char *to, const char *from,
+                         struct dx_map_entry *map, unsigned count)
+{
+	unsigned chunk_size = ext2_chunk_size(dir);
+	ext2_dirent *de = (ext2_dirent *)to;
+	char *p = to;
+	unsigned i;
+
+	memset(to, 0, chunk_size);
+	for (i = 0; i < count; i++) {
+		de = (ext2_dirent *)p;
+		memcpy(p, from + map[i].offs, map[i].size);
+		de->rec_len = cpu_to_le16(map[i].size);
+		p += map[i].size;
+	}
+	de->rec_len = cpu_to_le16(to + chunk_size - (char *)de);
+}
+
+static int ext2_dx_map_cmp(const void *a, const void *b)
+{
+	const struct dx_map_entry *p = a, *q = b;
+
+	return p->hash < q->hash ? -1 : p->hash > q->hash;
+}
+
+/*
+ * Splits the full leaf below frame: the names in its upper half by hash,
+ * about half of its bytes, move to a new block at the end of the
+ * directory, which the index then points to from that hash on.
+ */
+static int ext2_dx_split_leaf(struct inode *dir, struct dx_frame *frame,
+                              int hash_version)
+{
+	unsigned chunk_size = ext2_chunk_size(dir);
+	unsigned long newblock = dir->i_size >> dir->i_blkbits;
+	struct dx_map_entry *map;
+	struct folio *folio;
+	unsigned count, split, size = 0;
+	char *kaddr, *buf;
+	u32 hash2;
+	int err = -ENOMEM;
+
+	buf = kmalloc(2 * chunk_size, GFP_KERNEL);
+	map = kmalloc_array(chunk_size / EXT2_DIR_REC_LEN(1), sizeof(*map),
+	                    GFP_KERNEL);
+	if (!buf || !map)
+		goto out;
+
+	kaddr = ext2_dx_get_chunk(dir, frame->next, &folio);
+	if (IS_ERR(kaddr)) {
+		err = PTR_ERR(kaddr);
+		goto out;
+	}
+	memcpy(buf, kaddr, chunk_size);
+	folio_release_kmap(folio, kaddr);
+
+	count = ext2_dx_make_map(dir, hash_version, buf, 0, map);
+	err = -ENOSPC;
+	if (count < 2)
+		goto out;
+	sort(map, count, sizeof(*map), ext2_dx_map_cmp, NULL);
+
+	for (split = count; split > 1; split--) {
+		if (size + map[split - 1].size > chunk_size / 2)
+			break;
+		size += map[split - 1].size;
+	}
+	if (split == count)
+		split--;
+
+	/* If the split falls among equal hashes, mark it for the lookups. */
+	hash2 = map[split].hash;
+	if (hash2 == map[split - 1].hash)
+		hash2 |= 1;
+
+	/*
+	 * Write the new leaf before the index points to it, and trim the old
+	 * one only after: on the way, names are found twice, never missed.
+	 */
+	ext2_dx_pack(dir, buf + chunk_size, buf, map + split, count - split);
+	err = ext2_dx_write_chunk(dir, newblock, buf + chunk_size);
+	if (!err)
+		err = ext2_dx_insert_index(dir, frame, hash2, newblock);
+	if (!err) {
+		ext2_dx_pack(dir, buf + chunk_size, buf, map, split);
+		err = ext2_dx_write_chunk(dir, frame->next, buf + chunk_size);
+	}
+out:
+	kfree(map);
+	kfree(buf);
+	return err;
+}
+
+/*
+ * Makes room in the index above a leaf that has to split, the node of the
+ * last of the nframes frames being full. A full root hands its entries to
+ * a new node below it, and a full node splits in two; but with the root
+ * above it full as well, the directory can not grow any more.
+ */
+static int ext2_dx_grow_index(struct inode *dir, struct dx_frame *frames,
+                              int nframes)
+{
+	unsigned chunk_size = ext2_chunk_size(dir);
+	unsigned long newblock = dir->i_size >> dir->i_blkbits;
+	struct dx_frame *frame = frames + nframes - 1;
+	struct dx_entry *entries;
+	struct dx_node *node;
+	struct folio *folio;
+	unsigned count, count1;
+	char *kaddr, *buf;
+	u32 hash2;
+	int err;
+
+	if (nframes == DX_MAX_LEVELS && frames[0].count == frames[0].limit) {
+		ext2_msg(dir->i_sb, KERN_WARNING,
+		         "warning: %s: index of directory #%lu is full",
+		         __func__, dir->i_ino);
+		return -ENOSPC;
+	}
+
+	buf = kzalloc(chunk_size, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	node = (struct dx_node *)buf;
+	node->fake.rec_len = cpu_to_le16(chunk_size);
+
+	kaddr = ext2_dx_get_chunk(dir, frame->block, &folio);
+	if (IS_ERR(kaddr)) {
+		err = PTR_ERR(kaddr);
+		goto out;
+	}
+	entries = (struct dx_entry *)(kaddr + frame->offs);
+	count = dx_get_count(entries);
+	count1 = nframes == 1 ? 0 : count / 2;
+	hash2 = dx_get_hash(entries + count1);
+	memcpy(node->entries, entries + count1,
+	       (count - count1) * sizeof(struct dx_entry));
+	folio_release_kmap(folio, kaddr);
+	dx_set_limit(node->entries, dx_node_limit(dir));
+	dx_set_count(node->entries, count - count1);
+
+	err = ext2_dx_write_chunk(dir, newblock, buf);
+	if (err)
+		goto out;
+
+	if (nframes == 1) {
+		struct dx_root *root;
+
+		root = (struct dx_root *)ext2_dx_begin_chunk(dir, 0, &folio);
+		if (IS_ERR(root)) {
+			err = PTR_ERR(root);
+			goto out;
+		}
+		dx_set_count(root->entries, 1);
+		root->entries[0].block = cpu_to_le32(newblock);
+		root->info.indirect_levels = 1;
+		ext2_dx_end_chunk(dir, 0, folio, (char *)root);
+		goto out;
+	}
+
+	err = ext2_dx_insert_index(dir, frames, hash2, newblock);
+	if (err)
+		goto out;
+	kaddr = ext2_dx_begin_chunk(dir, frame->block, &folio);
+	if (IS_ERR(kaddr)) {
+		err = PTR_ERR(kaddr);
+		goto out;
+	}
+	entries = (struct dx_entry *)(kaddr + frame->offs);
+	dx_set_count(entries, count1);
+	ext2_dx_end_chunk(dir, frame->block, folio, kaddr);
+out:
+	kfree(buf);
+	return err;
+}
+
+/*
+ * Adds the name to an indexed directory. Whenever the leaf for its hash
+ * is full, split it, and the index above it first if that is full too,
+ * and look again.
+ */
+static int ext2_dx_add_link(struct dentry *dentry, struct inode *inode)
+{
+	struct inode *dir = d_inode(dentry->d_parent);
+	struct dx_frame frames[DX_MAX_LEVELS];
+	struct dx_hash_info hinfo;
+	struct dx_frame *frame;
+	struct folio *folio;
+	ext2_dirent *de;
+	int nframes, err;
+
+	de = ext2_dx_find_entry(dir, &dentry->d_name, &folio);
+	if (!IS_ERR(de)) {
+		folio_release_kmap(folio, de);
+		return -EEXIST;
+	}
+	if (PTR_ERR(de) != -ENOENT)
+		return PTR_ERR(de);
+
+	for (;;) {
+		nframes = ext2_dx_probe(dir, &dentry->d_name, &hinfo, frames);
+		if (nframes < 0)
+			return nframes;
+		frame = frames + nframes - 1;
+
+		err = ext2_dx_add_to_leaf(dir, frame->next, &dentry->d_name, inode);
+		if (err != -ENOSPC)
+			return err;
+
+		if (frame->count == frame->limit)
+			err = ext2_dx_grow_index(dir, frames, nframes);
+		else
+			err = ext2_dx_split_leaf(dir, frame, hinfo.hash_version);
+		if (err)
+			return err;
+	}
+}
+
+/*
+ * Whether dir, down to its last free byte in a single block, can become
+ * indexed: the block has to start with "." and "..", the way
+ * ext2_make_empty() lays them out, for the root to go after them.
+ */
+static bool ext2_dx_can_index(struct inode *dir)
+{
+	struct folio *folio;
+	ext2_dirent *de;
+	bool ret;
+
+	if (!ext2_has_dir_index(dir->i_sb) ||
+	    dir->i_size != ext2_chunk_size(dir))
+		return false;
+
+	de = (ext2_dirent *)ext2_dx_get_chunk(dir, 0, &folio);
+	if (IS_ERR(de))
+		return false;
+	ret = le16_to_cpu(de->rec_len) == EXT2_DIR_REC_LEN(1) &&
+	      de->name_len == 1 && de->name[0] == '.';
+	if (ret) {
+		ext2_dirent *dotdot = ext2_next_entry(de);
+
+		ret = dotdot->name_len == 2 && dotdot->name[0] == '.' &&
+		      dotdot->name[1] == '.';
+	}
+	folio_release_kmap(folio, de);
+	return ret;
+}
+
+/*
+ * A directory that outgrows its first block becomes indexed: the names
+ * after ".." move to a second block, the single leaf of a new index whose
+ * root takes the rest of the first one. Then the name is added.
+ */
+static int ext2_dx_make_indexed(struct dentry *dentry, struct inode *inode)
+{
+	struct inode *dir = d_inode(dentry->d_parent);
+	struct ext2_super_block *es = EXT2_SB(dir->i_sb)->s_es;
+	unsigned chunk_size = ext2_chunk_size(dir);
+	int hash_version = min_t(int, es->s_def_hash_version, DX_HASH_TEA);
+	struct dx_map_entry *map;
+	struct dx_root *root;
+	struct folio *folio;
+	unsigned count;
+	char *kaddr, *buf;
+	int err = -ENOMEM;
+
+	buf = kmalloc(2 * chunk_size, GFP_KERNEL);
+	map = kmalloc_array(chunk_size / EXT2_DIR_REC_LEN(1), sizeof(*map),
+	                    GFP_KERNEL);
+	if (!buf || !map)
+		goto out;
+
+	kaddr = ext2_dx_get_chunk(dir, 0, &folio);
+	if (IS_ERR(kaddr)) {
+		err = PTR_ERR(kaddr);
+		goto out;
+	}
+	memcpy(buf, kaddr, chunk_size);
+	folio_release_kmap(folio, kaddr);
+
+	root = (struct dx_root *)buf;
+	count = ext2_dx_make_map(dir, hash_version, buf,
+	                         EXT2_DIR_REC_LEN(1) + le16_to_cpu(root->dotdot.rec_len),
+	                         map);
+	ext2_dx_pack(dir, buf + chunk_size, buf, map, count);
+	err = ext2_dx_write_chunk(dir, 1, buf + chunk_size);
+	if (err)
+		goto out;
+
+	root->dotdot.rec_len = cpu_to_le16(chunk_size - EXT2_DIR_REC_LEN(1));
+	memset(&root->info, 0, chunk_size - offsetof(struct dx_root, info));
+	root->info.hash_version = hash_version;
+	root->info.info_length = sizeof(root->info);
+	dx_set_limit(root->entries, dx_root_limit(dir));
+	dx_set_count(root->entries, 1);
+	root->entries[0].block = cpu_to_le32(1);
+	err = ext2_dx_write_chunk(dir, 0, buf);
+	if (err)
+		goto out;
+
+	EXT2_I(dir)->i_flags |= EXT2_INDEX_FL;
+	mark_inode_dirty(dir);
+	err = ext2_dx_add_link(dentry, inode);
+out:
+	kfree(map);
+	kfree(buf);
+	return err;
+}
+
 /*
  * dentry->d_parent inode is locked by the VFS code.
  */
@@ -355,18 +1334,29 @@ int ext2_add_link(struct dentry *dentry, struct inode *inode)
 	ext2_dirent *de;
 	unsigned long npages = dir_pages(dir);
 	unsigned long n;
-	loff_t pos;
+	char *kaddr;
 	int err;
 
+	if (EXT2_I(dir)->i_flags & EXT2_INDEX_FL) {
+		if (ext2_has_dir_index(dir->i_sb)) {
+			err = ext2_dx_add_link(dentry, inode);
+			if (err != ERR_BAD_DX_DIR)
+				goto out;
+		}
+		/* The linear insert below would overwrite the index. */
+		EXT2_I(dir)->i_flags &= ~EXT2_INDEX_FL;
+		mark_inode_dirty(dir);
+	}
+
 	/*
 	 * We take care of directory expansion in the same loop.
 	 * This code plays outside i_size, so it locks the page
 	 * to protect that region.
 	 */
 	for (n = 0; n <= npages; n++) {
-		char *kaddr = ext2_get_folio(dir, n, 0, &folio);
 		char *dir_end;
 
+		kaddr = ext2_get_folio(dir, n, 0, &folio);
 		if (IS_ERR(kaddr))
 			return PTR_ERR(kaddr);
 		folio_lock(folio);
@@ -376,8 +1366,8 @@ int ext2_add_link(struct dentry *dentry, struct inode *inode)
 		while ((char *)de <= kaddr) {
 			if ((char *)de == dir_end) {
 				/* We hit i_size */
-				name_len = 0;
-				rec_len = chunk_size;
+				if (ext2_dx_can_index(dir))
+					goto make_indexed;
 				de->rec_len = cpu_to_le16(chunk_size);
 				de->inode = 0;
 				goto got_it;
@@ -406,32 +1396,26 @@ int ext2_add_link(struct dentry *dentry, struct inode *inode)
 	return -EINVAL;
 
 got_it:
-	pos = folio_pos(folio) + offset_in_folio(folio, de);
-	err = ext2_prepare_chunk(folio, pos, rec_len);
+	err = ext2_insert_entry(folio, de, &dentry->d_name, inode);
+	folio_release_kmap(folio, de);
+out:
 	if (err)
-		goto out_unlock;
-	if (de->inode) {
-		ext2_dirent *de1 = (ext2_dirent *)((char *) de + name_len);
-		de1->rec_len = cpu_to_le16(rec_len - name_len);
-		de->rec_len = cpu_to_le16(name_len);
-		de = de1;
-	}
-	de->name_len = namelen;
-	memcpy(de->name, name, namelen);
-	de->inode = cpu_to_le32(inode->i_ino);
-	de->file_type = 0;
-	ext2_commit_chunk(folio, pos, rec_len);
+		return err;
 	inode_set_mtime_to_ts(dir, inode_set_ctime_current(dir));
 	mark_inode_dirty(dir);
 	err = filemap_write_and_wait(dir->i_mapping);
 	if (!err)
 		err = sync_inode_metadata(dir, 1);
-out_put:
-	folio_release_kmap(folio, de);
 	return err;
 out_unlock:
 	folio_unlock(folio);
-	goto out_put;
+	folio_release_kmap(folio, de);
+	return err;
+make_indexed:
+	folio_unlock(folio);
+	folio_release_kmap(folio, kaddr);
+	err = ext2_dx_make_indexed(dentry, inode);
+	goto out;
 }
 
 /*
@@ -0,0 +1,87 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * ext2_extents.h
+ *
+ * On-disk format of the extent tree, the optional alternative to the
+ * block-mapped i_block of ext2-lite. The layout is the one of ext4:
+ * i_block holds the root of the tree, a header followed by up to 4
+ * entries, and the rest of the tree lives in blocks of its own.
+ *
+ */
+
+#ifndef _EXT2_EXTENTS_H
+#define _EXT2_EXTENTS_H
+
+#include <linux/hash.h>
+#include <linux/rwsem.h>
+#include "ext2.h"
+
+/* Superblock feature and inode flag, same values as in ext4. */
+#define EXT2_FEATURE_INCOMPAT_EXTENTS	0x0040
+#define EXT2_EXTENTS_FL			0x00080000 /* Inode uses extents */
+
+#define EXT2_EXT_MAGIC		0xf30a
+#define EXT2_EXT_MAX_LEN	32768	/* Max blocks in a single extent */
+#define EXT2_EXT_MAX_DEPTH	5
+#define EXT2_EXT_MAX_BLOCKS	0xffffffff
+
+/* Every node of the tree starts with this header. */
+struct ext2_extent_header {
+	__le16	eh_magic;	/* EXT2_EXT_MAGIC */
+	__le16	eh_entries;	/* number of valid entries */
+	__le16	eh_max;		/* capacity of the node in entries */
+	__le16	eh_depth;	/* 0 for leaves */
+	__le32	eh_generation;
+};
+
+/* Leaf entry: ee_len blocks from logical ee_block on are contiguous on disk. */
+struct ext2_extent {
+	__le32	ee_block;	/* first logical block */
+	__le16	ee_len;		/* number of blocks */
+	__le16	ee_start_hi;	/* high 16 bits of the physical block */
+	__le32	ee_start_lo;	/* low 32 bits of the physical block */
+};
+
+/* Index entry: the subtree at ei_leaf covers logical blocks from ei_block on. */
+struct ext2_extent_idx {
+	__le32	ei_block;
+	__le32	ei_leaf_lo;	/* low 32 bits of the child node */
+	__le16	ei_leaf_hi;	/* high 16 bits of the child node */
+	__u16	ei_unused;
+};
+
+static inline int ext2_has_extents(struct super_block *sb)
+{
+	return !!(EXT2_SB(sb)->s_es->s_feature_incompat &
+	          cpu_to_le32(EXT2_FEATURE_INCOMPAT_EXTENTS));
+}
+
+static inline int ext2_inode_has_extents(struct inode *inode)
+{
+	return !!(EXT2_I(inode)->i_flags & EXT2_EXTENTS_FL);
+}
+
+/*
+ * The block map of an inode, its extent tree or its indirect blocks, is
+ * changed under the write side of one of these and walked under the read
+ * side. They are hashed by inode so that we do not have to grow
+ * ext2_inode_info.
+ */
+#define EXT2_MAP_LOCKS_BITS	6
+extern struct rw_semaphore ext2_map_locks[1 << EXT2_MAP_LOCKS_BITS];
+
+static inline struct rw_semaphore *ext2_map_lock(struct inode *inode)
+{
+	return &ext2_map_locks[hash_ptr(inode, EXT2_MAP_LOCKS_BITS)];
+}
+
+/* extents.c */
+extern void ext2_ext_init(void);
+extern void ext2_ext_tree_init(struct inode *inode);
+extern int ext2_ext_check_inode(struct inode *inode);
+extern int ext2_ext_get_blocks(struct inode *inode, sector_t iblock,
+                               unsigned long maxblocks, u32 *bno,
+                               bool *new, int create);
+extern void ext2_ext_truncate(struct inode *inode, sector_t iblock);
+
+#endif /* _EXT2_EXTENTS_H */
@@ -0,0 +1,801 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * extents.c
+ *
+ * This file contains the extent tree based block mapping, used instead of
+ * the direct/indirect blocks by the inodes that have EXT2_EXTENTS_FL set.
+ *
+ * Each leaf entry maps a run of logical blocks to a run of contiguous
+ * blocks on disk, so a large contiguous file needs a handful of entries
+ * and a lookup is a binary search in each of the few levels of the tree.
+ *
+ */
+
+#include <linux/buffer_head.h>
+#include "ext2.h"
+#include "ext2_extents.h"
+
+#define EXT2_FIRST_EXTENT(hdr) \
+	((struct ext2_extent *)(((char *)(hdr)) + sizeof(struct ext2_extent_header)))
+#define EXT2_FIRST_INDEX(hdr) \
+	((struct ext2_extent_idx *)(((char *)(hdr)) + sizeof(struct ext2_extent_header)))
+#define EXT2_LAST_EXTENT(hdr) \
+	(EXT2_FIRST_EXTENT(hdr) + le16_to_cpu((hdr)->eh_entries) - 1)
+#define EXT2_LAST_INDEX(hdr) \
+	(EXT2_FIRST_INDEX(hdr) + le16_to_cpu((hdr)->eh_entries) - 1)
+#define EXT2_HAS_FREE_INDEX(path) \
+	(le16_to_cpu((path)->p_hdr->eh_entries) < le16_to_cpu((path)->p_hdr->eh_max))
+
+/*
+ * One node on the way from the root to a leaf: p_hdr is the node, p_bh its
+ * buffer (NULL for the root in i_data) and p_idx/p_ext the entry that
+ * covers the logical block we looked for.
+ */
+struct ext2_ext_path {
+	struct buffer_head        *p_bh;
+	struct ext2_extent_header *p_hdr;
+	struct ext2_extent_idx    *p_idx;
+	struct ext2_extent        *p_ext;
+};
+
+struct rw_semaphore ext2_map_locks[1 << EXT2_MAP_LOCKS_BITS];
+
+void __init ext2_ext_init(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(ext2_map_locks); i++)
+		init_rwsem(&ext2_map_locks[i]);
+}
+
+static inline struct ext2_extent_header *ext_inode_hdr(struct inode *inode)
+{
+	return (struct ext2_extent_header *)EXT2_I(inode)->i_data;
+}
+
+static inline struct ext2_extent_header *ext_block_hdr(struct buffer_head *bh)
+{
+	return (struct ext2_extent_header *)bh->b_data;
+}
+
+static inline int ext_depth(struct inode *inode)
+{
+	return le16_to_cpu(ext_inode_hdr(inode)->eh_depth);
+}
+
+static inline int ext_space_root(struct inode *inode)
+{
+	return (sizeof(EXT2_I(inode)->i_data) - sizeof(struct ext2_extent_header)) /
+	       sizeof(struct ext2_extent);
+}
+
+static inline int ext_space_block(struct inode *inode)
+{
+	return (inode->i_sb->s_blocksize - sizeof(struct ext2_extent_header)) /
+	       sizeof(struct ext2_extent);
+}
+
+static inline ext2_fsblk_t ext2_ext_pblock(struct ext2_extent *ex)
+{
+	return le32_to_cpu(ex->ee_start_lo) |
+	       ((ext2_fsblk_t)le16_to_cpu(ex->ee_start_hi) << 31) << 1;
+}
+
+static inline void ext2_ext_store_pblock(struct ext2_extent *ex, ext2_fsblk_t pb)
+{
+	ex->ee_start_lo = cpu_to_le32(pb & 0xffffffff);
+	ex->ee_start_hi = 0;
+}
+
+static inline ext2_fsblk_t ext2_idx_pblock(struct ext2_extent_idx *ix)
+{
+	return le32_to_cpu(ix->ei_leaf_lo) |
+	       ((ext2_fsblk_t)le16_to_cpu(ix->ei_leaf_hi) << 31) << 1;
+}
+
+static inline void ext2_idx_store_pblock(struct ext2_extent_idx *ix, ext2_fsblk_t pb)
+{
+	ix->ei_leaf_lo = cpu_to_le32(pb & 0xffffffff);
+	ix->ei_leaf_hi = 0;
+}
+
+static int ext2_ext_check(struct inode *inode, struct ext2_extent_header *eh,
+                          int depth, int max)
+{
+	const char *error_msg = NULL;
+
+	if (eh->eh_magic != cpu_to_le16(EXT2_EXT_MAGIC))
+		error_msg = "invalid magic";
+	else if (le16_to_cpu(eh->eh_depth) != depth || depth > EXT2_EXT_MAX_DEPTH)
+		error_msg = "unexpected eh_depth";
+	else if (eh->eh_max == 0 || le16_to_cpu(eh->eh_max) > max)
+		error_msg = "invalid eh_max";
+	else if (le16_to_cpu(eh->eh_entries) > le16_to_cpu(eh->eh_max))
+		error_msg = "invalid eh_entries";
+	else if (depth > 0 && eh->eh_entries == 0)
+		error_msg = "empty index node";
+
+	if (!error_msg)
+		return 0;
+
+	ext2_error(inode->i_sb, __func__, "bad extent header in inode #%lu: %s - "
+	           "magic=%x, entries=%u, max=%u, depth=%u(%d)", inode->i_ino,
+	           error_msg, le16_to_cpu(eh->eh_magic), le16_to_cpu(eh->eh_entries),
+	           le16_to_cpu(eh->eh_max), le16_to_cpu(eh->eh_depth), depth);
+	return -EIO;
+}
+
+/* Validates the root of the tree, right after reading the inode from disk. */
+int ext2_ext_check_inode(struct inode *inode)
+{
+	return ext2_ext_check(inode, ext_inode_hdr(inode), ext_depth(inode),
+	                      ext_space_root(inode));
+}
+
+/* Makes i_data the root of an empty tree, for a new inode that the caller
+ * marks dirty. */
+void ext2_ext_tree_init(struct inode *inode)
+{
+	struct ext2_extent_header *eh = ext_inode_hdr(inode);
+
+	eh->eh_magic = cpu_to_le16(EXT2_EXT_MAGIC);
+	eh->eh_entries = 0;
+	eh->eh_max = cpu_to_le16(ext_space_root(inode));
+	eh->eh_depth = 0;
+	eh->eh_generation = 0;
+}
+
+static void ext2_ext_drop_refs(struct ext2_ext_path *path)
+{
+	int i;
+
+	for (i = 0; i <= EXT2_EXT_MAX_DEPTH; i++) {
+		brelse(path[i].p_bh);
+		path[i].p_bh = NULL;
+	}
+}
+
+static void ext2_ext_dirty(struct inode *inode, struct ext2_ext_path *path)
+{
+	if (path->p_bh)
+		mark_buffer_dirty_inode(path->p_bh, inode);
+	else
+		mark_inode_dirty(inode);
+}
+
+/*
+ * Binary search for the last entry whose first logical block is not after
+ * block. If all of them are after it, we settle for the first entry.
+ */
+static void ext2_ext_binsearch_idx(struct ext2_ext_path *path, u32 block)
+{
+	struct ext2_extent_idx *l, *r, *m;
+
+	l = EXT2_FIRST_INDEX(path->p_hdr) + 1;
+	r = EXT2_LAST_INDEX(path->p_hdr);
+	while (l <= r) {
+		m = l + (r - l) / 2;
+		if (block < le32_to_cpu(m->ei_block))
+			r = m - 1;
+		else
+			l = m + 1;
+	}
+	path->p_idx = l - 1;
+}
+
+static void ext2_ext_binsearch(struct ext2_ext_path *path, u32 block)
+{
+	struct ext2_extent *l, *r, *m;
+
+	if (path->p_hdr->eh_entries == 0)
+		return;
+
+	l = EXT2_FIRST_EXTENT(path->p_hdr) + 1;
+	r = EXT2_LAST_EXTENT(path->p_hdr);
+	while (l <= r) {
+		m = l + (r - l) / 2;
+		if (block < le32_to_cpu(m->ee_block))
+			r = m - 1;
+		else
+			l = m + 1;
+	}
+	path->p_ext = l - 1;
+}
+
+/*
+ * Walks the tree from the root down to the leaf that should map block,
+ * filling path[0..depth]. On error no buffer heads are left in path.
+ */
+static int ext2_ext_find_extent(struct inode *inode, u32 block,
+                                struct ext2_ext_path *path)
+{
+	struct ext2_extent_header *eh = ext_inode_hdr(inode);
+	struct buffer_head *bh;
+	int depth = ext_depth(inode);
+	int i, ppos = 0;
+
+	memset(path, 0, sizeof(*path) * (EXT2_EXT_MAX_DEPTH + 1));
+	path[0].p_hdr = eh;
+	for (i = depth; i > 0; i--, ppos++) {
+		ext2_ext_binsearch_idx(path + ppos, block);
+		bh = sb_bread(inode->i_sb, ext2_idx_pblock(path[ppos].p_idx));
+		if (!bh) {
+			ext2_error(inode->i_sb, __func__, "unable to read extent block %lu of inode %lu",
+			           ext2_idx_pblock(path[ppos].p_idx), inode->i_ino);
+			goto err;
+		}
+		eh = ext_block_hdr(bh);
+		path[ppos + 1].p_bh = bh;
+		path[ppos + 1].p_hdr = eh;
+		if (ext2_ext_check(inode, eh, i - 1, ext_space_block(inode)))
+			goto err;
+	}
+	ext2_ext_binsearch(path + ppos, block);
+	return 0;
+
+err:
+	ext2_ext_drop_refs(path);
+	return -EIO;
+}
+
+/*
+ * If the extent found by ext2_ext_find_extent() maps block, returns how many
+ * blocks from block on it maps, up to maxblocks, and sets *bno. Else 0.
+ */
+static int ext2_ext_map(struct inode *inode, struct ext2_ext_path *path,
+                        u32 block, unsigned long maxblocks, u32 *bno)
+{
+	struct ext2_extent *ex = path[ext_depth(inode)].p_ext;
+	u32 ee_block;
+	unsigned int ee_len;
+
+	*bno = 0;
+	if (!ex)
+		return 0;
+
+	ee_block = le32_to_cpu(ex->ee_block);
+	ee_len = le16_to_cpu(ex->ee_len);
+	if (block < ee_block || block >= ee_block + ee_len)
+		return 0;
+
+	*bno = ext2_ext_pblock(ex) + (block - ee_block);
+	return min_t(unsigned long, maxblocks, ee_block + ee_len - block);
+}
+
+/* The first mapped logical block after block, which bounds the hole at block. */
+static u32 ext2_ext_next_allocated(struct inode *inode, struct ext2_ext_path *path,
+                                   u32 block)
+{
+	int depth = ext_depth(inode);
+	struct ext2_extent *ex = path[depth].p_ext;
+	int k;
+
+	if (ex) {
+		if (le32_to_cpu(ex->ee_block) > block)
+			return le32_to_cpu(ex->ee_block);
+		if (ex != EXT2_LAST_EXTENT(path[depth].p_hdr))
+			return le32_to_cpu(ex[1].ee_block);
+	}
+	for (k = depth - 1; k >= 0; k--)
+		if (path[k].p_idx != EXT2_LAST_INDEX(path[k].p_hdr))
+			return le32_to_cpu(path[k].p_idx[1].ei_block);
+
+	return EXT2_EXT_MAX_BLOCKS;
+}
+
+/*
+ * Where to try to allocate block: at the physical position it would have if
+ * the nearest extent grew to reach it, else right after the leaf that will
+ * map it, or else at the start of the inode's block group.
+ */
+static ext2_fsblk_t ext2_ext_find_goal(struct inode *inode,
+                                       struct ext2_ext_path *path, u32 block)
+{
+	int depth = ext_depth(inode);
+	struct ext2_extent *ex = path[depth].p_ext;
+
+	if (ex) {
+		ext2_fsblk_t ext_pblk = ext2_ext_pblock(ex);
+		u32 ext_block = le32_to_cpu(ex->ee_block);
+
+		if (block > ext_block)
+			return ext_pblk + (block - ext_block);
+		return ext_pblk - (ext_block - block);
+	}
+	if (path[depth].p_bh)
+		return path[depth].p_bh->b_blocknr;
+
+	return ext2_group_first_block_no(inode->i_sb, EXT2_I(inode)->i_block_group);
+}
+
+/* Allocates one block for a node of the tree. */
+static ext2_fsblk_t ext2_ext_new_meta_block(struct inode *inode,
+                                            ext2_fsblk_t goal, int *err)
+{
+	unsigned long count = 1;
+	ext2_fsblk_t block;
+
+	block = ext2_new_blocks(inode, goal, &count, err);
+	if (*err)
+		return 0;
+	inode->i_blocks += inode->i_sb->s_blocksize / 512;
+	return block;
+}
+
+/* Returns the buffer of a new, empty node of the tree at block. */
+static struct buffer_head *ext2_ext_new_node(struct inode *inode,
+                                             ext2_fsblk_t block, int depth)
+{
+	struct ext2_extent_header *eh;
+	struct buffer_head *bh;
+
+	bh = sb_getblk(inode->i_sb, block);
+	if (unlikely(!bh))
+		return NULL;
+
+	lock_buffer(bh);
+	memset(bh->b_data, 0, inode->i_sb->s_blocksize);
+	eh = ext_block_hdr(bh);
+	eh->eh_magic = cpu_to_le16(EXT2_EXT_MAGIC);
+	eh->eh_max = cpu_to_le16(ext_space_block(inode));
+	eh->eh_depth = cpu_to_le16(depth);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	return bh;
+}
+
+/*
+ * The first extent of the leaf in path has changed its logical block;
+ * update the keys of the indexes above it that it is the first entry of.
+ */
+static void ext2_ext_correct_indexes(struct inode *inode, struct ext2_ext_path *path)
+{
+	int depth = ext_depth(inode);
+	__le32 border;
+	int k;
+
+	if (depth == 0)
+		return;
+
+	border = path[depth].p_ext->ee_block;
+	for (k = depth - 1; k >= 0; k--) {
+		path[k].p_idx->ei_block = border;
+		ext2_ext_dirty(inode, path + k);
+		if (path[k].p_idx != EXT2_FIRST_INDEX(path[k].p_hdr))
+			break;
+	}
+}
+
+/* Inserts an index entry for logical block onwards to the node in curp. */
+static void ext2_ext_insert_index(struct inode *inode, struct ext2_ext_path *curp,
+                                  u32 logical, ext2_fsblk_t ptr)
+{
+	struct ext2_extent_idx *ix = curp->p_idx;
+	int len;
+
+	if (logical > le32_to_cpu(ix->ei_block))
+		ix++;
+	len = EXT2_LAST_INDEX(curp->p_hdr) - ix + 1;
+	if (len > 0)
+		memmove(ix + 1, ix, len * sizeof(struct ext2_extent_idx));
+	ix->ei_block = cpu_to_le32(logical);
+	ext2_idx_store_pblock(ix, ptr);
+	le16_add_cpu(&curp->p_hdr->eh_entries, 1);
+	ext2_ext_dirty(inode, curp);
+}
+
+/*
+ * Splits the full nodes on path below level at, which has room for one more
+ * index. The entries after the insertion point of each of them move to a
+ * new node, and the new branch is hooked into level at. When we append to
+ * the file nothing moves and the new leaf starts empty.
+ */
+static int ext2_ext_split(struct inode *inode, struct ext2_ext_path *path,
+                          u32 block, int at)
+{
+	int depth = ext_depth(inode);
+	int n = depth - at;
+	struct buffer_head *bhs[EXT2_EXT_MAX_DEPTH];
+	struct ext2_extent_header *neh;
+	struct ext2_extent_idx *fidx;
+	ext2_fsblk_t goal;
+	u32 border;
+	int i, k, m, err = 0;
+
+	if (path[depth].p_ext && path[depth].p_ext != EXT2_LAST_EXTENT(path[depth].p_hdr))
+		border = le32_to_cpu(path[depth].p_ext[1].ee_block);
+	else
+		border = block;
+
+	/* Get all the new nodes before touching the tree, bhs[0] hangs from at. */
+	goal = path[depth].p_bh->b_blocknr;
+	for (i = 0; i < n; i++) {
+		goal = ext2_ext_new_meta_block(inode, goal, &err);
+		if (err)
+			goto cleanup;
+		bhs[i] = ext2_ext_new_node(inode, goal, depth - at - 1 - i);
+		if (!bhs[i]) {
+			ext2_free_blocks(inode, goal, 1);
+			err = -ENOMEM;
+			goto cleanup;
+		}
+	}
+
+	/* The new leaf takes the extents after the insertion point. */
+	neh = ext_block_hdr(bhs[n - 1]);
+	m = path[depth].p_ext ? EXT2_LAST_EXTENT(path[depth].p_hdr) - path[depth].p_ext : 0;
+	if (m > 0) {
+		memmove(EXT2_FIRST_EXTENT(neh), path[depth].p_ext + 1,
+		        m * sizeof(struct ext2_extent));
+		neh->eh_entries = cpu_to_le16(m);
+		le16_add_cpu(&path[depth].p_hdr->eh_entries, -m);
+		ext2_ext_dirty(inode, path + depth);
+	}
+
+	/* Each new index node points to the new node below it and takes the
+	 * indexes after the insertion point. */
+	for (k = depth - 1; k > at; k--) {
+		neh = ext_block_hdr(bhs[k - at - 1]);
+		fidx = EXT2_FIRST_INDEX(neh);
+		fidx->ei_block = cpu_to_le32(border);
+		ext2_idx_store_pblock(fidx, bhs[k - at]->b_blocknr);
+		m = EXT2_LAST_INDEX(path[k].p_hdr) - path[k].p_idx;
+		if (m > 0) {
+			memmove(fidx + 1, path[k].p_idx + 1,
+			        m * sizeof(struct ext2_extent_idx));
+			le16_add_cpu(&path[k].p_hdr->eh_entries, -m);
+			ext2_ext_dirty(inode, path + k);
+		}
+		neh->eh_entries = cpu_to_le16(m + 1);
+	}
+
+	ext2_ext_insert_index(inode, path + at, border, bhs[0]->b_blocknr);
+	for (i = 0; i < n; i++) {
+		mark_buffer_dirty_inode(bhs[i], inode);
+		brelse(bhs[i]);
+	}
+	return 0;
+
+cleanup:
+	while (i-- > 0) {
+		goal = bhs[i]->b_blocknr;
+		bforget(bhs[i]);
+		ext2_free_blocks(inode, goal, 1);
+	}
+	return err;
+}
+
+/*
+ * The root is full: move its entries to a new node and make the root an
+ * index with that node as its only child, one level higher.
+ */
+static int ext2_ext_grow_indepth(struct inode *inode)
+{
+	struct ext2_extent_header *root = ext_inode_hdr(inode);
+	struct ext2_extent_idx *fidx = EXT2_FIRST_INDEX(root);
+	int depth = ext_depth(inode);
+	struct buffer_head *bh;
+	ext2_fsblk_t newblock, goal;
+	int err = 0;
+
+	if (depth >= EXT2_EXT_MAX_DEPTH) {
+		ext2_error(inode->i_sb, __func__, "extent tree of inode %lu too deep", inode->i_ino);
+		return -EIO;
+	}
+
+	/* Next to the first child, or to the data of a root that is a leaf. */
+	if (depth > 0)
+		goal = ext2_idx_pblock(fidx);
+	else if (root->eh_entries)
+		goal = ext2_ext_pblock(EXT2_FIRST_EXTENT(root));
+	else
+		goal = ext2_group_first_block_no(inode->i_sb, EXT2_I(inode)->i_block_group);
+	newblock = ext2_ext_new_meta_block(inode, goal, &err);
+	if (err)
+		return err;
+	bh = ext2_ext_new_node(inode, newblock, depth);
+	if (!bh) {
+		ext2_free_blocks(inode, newblock, 1);
+		return -ENOMEM;
+	}
+
+	memcpy(EXT2_FIRST_INDEX(ext_block_hdr(bh)), fidx,
+	       le16_to_cpu(root->eh_entries) * sizeof(struct ext2_extent_idx));
+	ext_block_hdr(bh)->eh_entries = root->eh_entries;
+	mark_buffer_dirty_inode(bh, inode);
+	brelse(bh);
+
+	/* ei_block overlays ee_block, so the first key is already in place. */
+	ext2_idx_store_pblock(fidx, newblock);
+	root->eh_entries = cpu_to_le16(1);
+	root->eh_depth = cpu_to_le16(depth + 1);
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+/*
+ * Makes room in the full leaf on path for an extent at block, splitting
+ * nodes or growing the tree by one level. path is looked up again.
+ */
+static int ext2_ext_create_new_leaf(struct inode *inode, struct ext2_ext_path *path,
+                                    u32 block)
+{
+	int depth, i, err;
+
+repeat:
+	depth = ext_depth(inode);
+	for (i = depth; i > 0 && !EXT2_HAS_FREE_INDEX(path + i); i--)
+		;
+
+	if (EXT2_HAS_FREE_INDEX(path + i)) {
+		err = ext2_ext_split(inode, path, block, i);
+		ext2_ext_drop_refs(path);
+		if (err)
+			return err;
+		return ext2_ext_find_extent(inode, block, path);
+	}
+
+	err = ext2_ext_grow_indepth(inode);
+	ext2_ext_drop_refs(path);
+	if (err)
+		return err;
+	err = ext2_ext_find_extent(inode, block, path);
+	if (err)
+		return err;
+
+	depth = ext_depth(inode);
+	if (!EXT2_HAS_FREE_INDEX(path + depth))
+		goto repeat;
+	return 0;
+}
+
+static inline int ext2_can_extents_be_merged(u32 block1, ext2_fsblk_t pblk1,
+                                             unsigned int len1, u32 block2,
+                                             ext2_fsblk_t pblk2, unsigned int len2)
+{
+	return block1 + len1 == block2 && pblk1 + len1 == pblk2 &&
+	       len1 + len2 <= EXT2_EXT_MAX_LEN;
+}
+
+/*
+ * Adds the extent (block, pblk, len) to the leaf on path, merging it with
+ * its neighbours when they are contiguous both logically and on disk.
+ */
+static int ext2_ext_insert_extent(struct inode *inode, struct ext2_ext_path *path,
+                                  u32 block, ext2_fsblk_t pblk, unsigned int len)
+{
+	int depth = ext_depth(inode);
+	struct ext2_extent_header *eh = path[depth].p_hdr;
+	struct ext2_extent *ex = path[depth].p_ext, *next = NULL;
+	int err, move;
+
+	if (ex) {
+		if (le32_to_cpu(ex->ee_block) > block)
+			next = ex;
+		else if (ex != EXT2_LAST_EXTENT(eh))
+			next = ex + 1;
+
+		if (next != ex &&
+		    ext2_can_extents_be_merged(le32_to_cpu(ex->ee_block), ext2_ext_pblock(ex),
+		                               le16_to_cpu(ex->ee_len), block, pblk, len)) {
+			le16_add_cpu(&ex->ee_len, len);
+			ext2_ext_dirty(inode, path + depth);
+			return 0;
+		}
+		if (next &&
+		    ext2_can_extents_be_merged(block, pblk, len, le32_to_cpu(next->ee_block),
+		                               ext2_ext_pblock(next), le16_to_cpu(next->ee_len))) {
+			next->ee_block = cpu_to_le32(block);
+			ext2_ext_store_pblock(next, pblk);
+			le16_add_cpu(&next->ee_len, len);
+			ext2_ext_dirty(inode, path + depth);
+			if (next == EXT2_FIRST_EXTENT(eh)) {
+				path[depth].p_ext = next;
+				ext2_ext_correct_indexes(inode, path);
+			}
+			return 0;
+		}
+	}
+
+	if (!EXT2_HAS_FREE_INDEX(path + depth)) {
+		err = ext2_ext_create_new_leaf(inode, path, block);
+		if (err)
+			return err;
+		depth = ext_depth(inode);
+		eh = path[depth].p_hdr;
+	}
+
+	ex = path[depth].p_ext;
+	if (!ex)
+		ex = EXT2_FIRST_EXTENT(eh);
+	else if (block > le32_to_cpu(ex->ee_block))
+		ex++;
+	move = EXT2_LAST_EXTENT(eh) - ex + 1;
+	if (move > 0)
+		memmove(ex + 1, ex, move * sizeof(struct ext2_extent));
+	ex->ee_block = cpu_to_le32(block);
+	ex->ee_len = cpu_to_le16(len);
+	ext2_ext_store_pblock(ex, pblk);
+	le16_add_cpu(&eh->eh_entries, 1);
+	path[depth].p_ext = ex;
+	ext2_ext_dirty(inode, path + depth);
+	if (ex == EXT2_FIRST_EXTENT(eh))
+		ext2_ext_correct_indexes(inode, path);
+	return 0;
+}
+
+/*
+ * The extent tree counterpart of ext2_get_blocks(): maps up to maxblocks
+ * blocks from iblock on that are contiguous on disk, which is at most what
+ * is left of the extent that maps iblock. When create is set, the hole at
+ * iblock is filled with a single new extent, as long as the allocator
+ * finds a free run.
+ * Returns the number of blocks mapped, setting *bno to the first one,
+ * 0 if iblock is a hole, or a negative error.
+ */
+int ext2_ext_get_blocks(struct inode *inode, sector_t iblock,
+                        unsigned long maxblocks, u32 *bno,
+                        bool *new, int create)
+{
+	struct ext2_ext_path path[EXT2_EXT_MAX_DEPTH + 1];
+	struct rw_semaphore *sem = ext2_map_lock(inode);
+	ext2_fsblk_t newblock;
+	unsigned long count;
+	int err;
+
+	if (iblock >= EXT2_EXT_MAX_BLOCKS)
+		return -EIO;
+	if (maxblocks == 0)
+		maxblocks = 1;
+
+	down_read(sem);
+	err = ext2_ext_find_extent(inode, iblock, path);
+	if (!err) {
+		err = ext2_ext_map(inode, path, iblock, maxblocks, bno);
+		ext2_ext_drop_refs(path);
+	}
+	up_read(sem);
+	if (err || !create)
+		return err;
+
+	/* Look again with the tree locked for writing, someone may have
+	 * filled the hole in the meantime. */
+	down_write(sem);
+	err = ext2_ext_find_extent(inode, iblock, path);
+	if (err)
+		goto out_unlock;
+	err = ext2_ext_map(inode, path, iblock, maxblocks, bno);
+	if (err)
+		goto out;
+
+	count = ext2_ext_next_allocated(inode, path, iblock) - iblock;
+	count = min3(count, maxblocks, (unsigned long)EXT2_EXT_MAX_LEN);
+	newblock = ext2_new_blocks(inode, ext2_ext_find_goal(inode, path, iblock),
+	                           &count, &err);
+	if (err)
+		goto out;
+	inode->i_blocks += (count * inode->i_sb->s_blocksize) / 512;
+
+	err = ext2_ext_insert_extent(inode, path, iblock, newblock, count);
+	if (err) {
+		ext2_free_blocks(inode, newblock, count);
+		goto out;
+	}
+	mark_inode_dirty(inode);
+	*bno = newblock;
+	*new = true;
+	err = count;
+	ext2_debug("allocated extent %llu-%llu for inode %lu: %lu\n",
+	           iblock, iblock + count - 1, inode->i_ino, newblock);
+out:
+	ext2_ext_drop_refs(path);
+out_unlock:
+	up_write(sem);
+	return err;
+}
+
+static int ext2_ext_rm_node(struct inode *inode, struct ext2_extent_header *eh,
+                            int depth, u32 start);
+
+/*
+ * Frees the blocks from start on that the leaf maps. They are a suffix of
+ * the leaf, so the entries are dropped from its end and each extent is
+ * freed with a single call.
+ */
+static void ext2_ext_rm_leaf(struct inode *inode, struct ext2_extent_header *eh,
+                             u32 start)
+{
+	struct ext2_extent *ex;
+	u32 ee_block;
+	unsigned int ee_len;
+
+	for (ex = EXT2_LAST_EXTENT(eh); ex >= EXT2_FIRST_EXTENT(eh); ex--) {
+		ee_block = le32_to_cpu(ex->ee_block);
+		ee_len = le16_to_cpu(ex->ee_len);
+		if (ee_block + ee_len <= start)
+			break;
+		if (ee_block >= start) {
+			ext2_free_blocks(inode, ext2_ext_pblock(ex), ee_len);
+			le16_add_cpu(&eh->eh_entries, -1);
+			memset(ex, 0, sizeof(*ex));
+		} else {
+			ext2_free_blocks(inode, ext2_ext_pblock(ex) + (start - ee_block),
+			                 ee_block + ee_len - start);
+			ex->ee_len = cpu_to_le16(start - ee_block);
+			break;
+		}
+	}
+}
+
+/*
+ * Same for an index node: the subtrees that start at or after start go
+ * whole, along with their nodes, and the one before them is trimmed.
+ */
+static int ext2_ext_rm_idx(struct inode *inode, struct ext2_extent_header *eh,
+                           int depth, u32 start)
+{
+	struct ext2_extent_idx *ix;
+	struct ext2_extent_header *neh;
+	struct buffer_head *bh;
+	ext2_fsblk_t pblk;
+	u32 ei_block;
+	int err;
+
+	for (ix = EXT2_LAST_INDEX(eh); ix >= EXT2_FIRST_INDEX(eh); ix--) {
+		ei_block = le32_to_cpu(ix->ei_block);
+		pblk = ext2_idx_pblock(ix);
+		bh = sb_bread(inode->i_sb, pblk);
+		if (!bh) {
+			ext2_error(inode->i_sb, __func__, "unable to read extent block %lu of inode %lu",
+			           pblk, inode->i_ino);
+			return -EIO;
+		}
+		neh = ext_block_hdr(bh);
+		err = ext2_ext_check(inode, neh, depth - 1, ext_space_block(inode));
+		if (!err)
+			err = ext2_ext_rm_node(inode, neh, depth - 1, start);
+		if (err) {
+			brelse(bh);
+			return err;
+		}
+
+		if (neh->eh_entries == 0) {
+			bforget(bh);
+			ext2_free_blocks(inode, pblk, 1);
+			le16_add_cpu(&eh->eh_entries, -1);
+			memset(ix, 0, sizeof(*ix));
+		} else {
+			mark_buffer_dirty_inode(bh, inode);
+			brelse(bh);
+		}
+		if (ei_block < start)
+			break;
+	}
+	return 0;
+}
+
+static int ext2_ext_rm_node(struct inode *inode, struct ext2_extent_header *eh,
+                            int depth, u32 start)
+{
+	if (depth == 0) {
+		ext2_ext_rm_leaf(inode, eh, start);
+		return 0;
+	}
+	return ext2_ext_rm_idx(inode, eh, depth, start);
+}
+
+/* Frees all the blocks of the inode from logical block iblock on. */
+void ext2_ext_truncate(struct inode *inode, sector_t iblock)
+{
+	struct rw_semaphore *sem = ext2_map_lock(inode);
+	struct ext2_extent_header *eh = ext_inode_hdr(inode);
+
+	if (iblock >= EXT2_EXT_MAX_BLOCKS)
+		return;
+
+	down_write(sem);
+	if (!ext2_ext_rm_node(inode, eh, ext_depth(inode), iblock) && eh->eh_entries == 0)
+		eh->eh_depth = 0;	/* an empty tree is a single leaf, the root */
+	mark_inode_dirty(inode);
+	up_write(sem);
+}
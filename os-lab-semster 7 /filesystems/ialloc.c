@@ -11,6 +11,7 @@
 #include <linux/backing-dev.h>
 #include <linux/buffer_head.h>
 #include "ext2.h"
+#include "ext2_extents.h"
 
 /*
  * The free inodes are managed by bitmaps. A file system contains several
@@ -273,11 +274,16 @@ got:
 	inode->i_blocks = 0;
 	simple_inode_init_ts(inode);
 	memset(ei->i_data, 0, sizeof(ei->i_data));
-	ei->i_flags = EXT2_I(dir)->i_flags;
+	ei->i_flags = EXT2_I(dir)->i_flags & ~(EXT2_EXTENTS_FL | EXT2_INDEX_FL);
 	ei->i_dtime = 0;
 	ei->i_block_group = group;
 	ei->i_state = EXT2_STATE_NEW;
 	ext2_set_inode_flags(inode);
+	//> Symlinks stay block-mapped: fast ones keep their target in i_data.
+	if (ext2_has_extents(sb) && (S_ISREG(mode) || S_ISDIR(mode))) {
+		ei->i_flags |= EXT2_EXTENTS_FL;
+		ext2_ext_tree_init(inode);
+	}
 	if (insert_inode_locked(inode) < 0) {
 		ext2_error(sb, __func__, "inode number already in use - inode=%lu", ino);
 		err = -EIO;
@@ -14,6 +14,7 @@
 #include <linux/namei.h>
 #include <linux/uio.h>
 #include "ext2.h"
+#include "ext2_extents.h"
 
 /* Necessary forward declarations of functions. */
 static void ext2_truncate_blocks(struct inode *inode, loff_t offset);
@@ -23,53 +24,430 @@ static inline int ext2_inode_is_fast_symlink(struct inode *inode)
 	return (S_ISLNK(inode->i_mode) && inode->i_blocks == 0);
 }
 
+/*
+ * One step of the walk from i_data down to a data block: p points to the
+ * slot holding the next block number, key is the number that was read from
+ * it and bh the indirect block that holds p (NULL for the slots in i_data).
+ */
+typedef struct {
+	__le32 *p;
+	__le32 key;
+	struct buffer_head *bh;
+} Indirect;
+
+static inline void add_chain(Indirect *p, struct buffer_head *bh, __le32 *v)
+{
+	p->key = *(p->p = v);
+	p->bh = bh;
+}
+
+/*
+ * Whether the steps from..to of a chain read earlier still hold the keys
+ * that were read, i.e. nobody changed that part of the tree meanwhile.
+ */
+static inline int verify_chain(Indirect *from, Indirect *to)
+{
+	while (from <= to && from->key == *from->p)
+		from++;
+	return (from > to);
+}
+
+static inline int all_zeroes(__le32 *p, __le32 *q)
+{
+	while (p < q)
+		if (*p++)
+			return 0;
+	return 1;
+}
+
+/*
+ * Translates the logical block i_block of the inode into its path through
+ * the block tree: offsets[0] is the slot in i_data and offsets[1..] are
+ * the slots in the indirect blocks below it.
+ * Returns the length of the path (1 for a direct block) or 0 if i_block is
+ * out of range. *boundary is set to how many slots follow the final one in
+ * the same block of pointers.
+ */
+static int ext2_block_to_path(struct inode *inode, long i_block,
+                              int offsets[4], int *boundary)
+{
+	int ptrs = EXT2_ADDR_PER_BLOCK(inode->i_sb);
+	int ptrs_bits = EXT2_ADDR_PER_BLOCK_BITS(inode->i_sb);
+	const long direct_blocks = EXT2_NDIR_BLOCKS,
+	           indirect_blocks = ptrs,
+	           double_blocks = (1 << (ptrs_bits * 2));
+	int n = 0;
+	int final = 0;
+
+	if (i_block < 0) {
+		ext2_msg(inode->i_sb, KERN_WARNING, "warning: %s: block < 0", __func__);
+	} else if (i_block < direct_blocks) {
+		offsets[n++] = i_block;
+		final = direct_blocks;
+	} else if ((i_block -= direct_blocks) < indirect_blocks) {
+		offsets[n++] = EXT2_IND_BLOCK;
+		offsets[n++] = i_block;
+		final = ptrs;
+	} else if ((i_block -= indirect_blocks) < double_blocks) {
+		offsets[n++] = EXT2_DIND_BLOCK;
+		offsets[n++] = i_block >> ptrs_bits;
+		offsets[n++] = i_block & (ptrs - 1);
+		final = ptrs;
+	} else if (((i_block -= double_blocks) >> (ptrs_bits * 2)) < ptrs) {
+		offsets[n++] = EXT2_TIND_BLOCK;
+		offsets[n++] = i_block >> (ptrs_bits * 2);
+		offsets[n++] = (i_block >> ptrs_bits) & (ptrs - 1);
+		offsets[n++] = i_block & (ptrs - 1);
+		final = ptrs;
+	} else {
+		ext2_msg(inode->i_sb, KERN_WARNING, "warning: %s: block is too big", __func__);
+	}
+	if (boundary)
+		*boundary = final - 1 - (i_block & (ptrs - 1));
+
+	return n;
+}
+
+/*
+ * Reads the chain of indirect blocks along the path given by offsets.
+ * Returns NULL if the whole path is mapped, or else the last mapped step of
+ * the chain, whose key is 0. On a read failure *err is set to -EIO.
+ * The caller has to brelse() the buffer heads left in chain[1..].
+ */
+static Indirect *ext2_get_branch(struct inode *inode, int depth, int *offsets,
+                                 Indirect chain[4], int *err)
+{
+	struct super_block *sb = inode->i_sb;
+	Indirect *p = chain;
+	struct buffer_head *bh;
+
+	*err = 0;
+	add_chain(chain, NULL, EXT2_I(inode)->i_data + *offsets);
+	if (!p->key)
+		goto no_block;
+	while (--depth) {
+		bh = sb_bread(sb, le32_to_cpu(p->key));
+		if (!bh)
+			goto failure;
+		add_chain(++p, bh, (__le32 *)bh->b_data + *++offsets);
+		if (!p->key)
+			goto no_block;
+	}
+	return NULL;
+
+failure:
+	*err = -EIO;
+no_block:
+	return p;
+}
+
+/*
+ * How many blocks, at most maxblocks, follow the one that the final step
+ * of a mapped chain points to contiguously on disk, within its block of
+ * pointers.
+ */
+static int ext2_mapped_run(Indirect *last, unsigned long maxblocks,
+                           int blocks_to_boundary)
+{
+	u32 first_block = le32_to_cpu(last->key);
+	int count;
+
+	for (count = 1; count < maxblocks && count <= blocks_to_boundary; count++)
+		if (le32_to_cpu(*(last->p + count)) != first_block + count)
+			break;
+	return count;
+}
+
+/*
+ * Where to try to allocate the block that ind is missing: right after the
+ * nearest mapped block before it in the same block of pointers, so that the
+ * file stays contiguous, else right after the indirect block that holds the
+ * pointer, or else at the start of the inode's block group.
+ */
+static ext2_fsblk_t ext2_find_goal(struct inode *inode, Indirect *ind)
+{
+	struct ext2_inode_info *ei = EXT2_I(inode);
+	__le32 *start = ind->bh ? (__le32 *)ind->bh->b_data : ei->i_data;
+	__le32 *p;
+
+	for (p = ind->p - 1; p >= start; p--)
+		if (*p)
+			return le32_to_cpu(*p) + (ind->p - p);
+
+	if (ind->bh)
+		return ind->bh->b_blocknr;
+
+	return ext2_group_first_block_no(inode->i_sb, ei->i_block_group);
+}
+
+/*
+ * How many data blocks to allocate for the branch, at most blks: all the
+ * slots up to the boundary if k indirect blocks are missing (they are new,
+ * hence empty), else the unmapped slots that follow branch[0].p.
+ */
+static int ext2_blks_to_allocate(Indirect *branch, int k, unsigned long blks,
+                                 int blocks_to_boundary)
+{
+	unsigned long count = 0;
+
+	if (k > 0)
+		return min_t(unsigned long, blks, blocks_to_boundary + 1);
+
+	count++;
+	while (count < blks && count <= blocks_to_boundary &&
+	       le32_to_cpu(*(branch[0].p + count)) == 0)
+		count++;
+	return count;
+}
+
+/*
+ * Allocates the indirect_blks missing indirect blocks and up to blks data
+ * blocks, in as few runs as the allocator gives us. The indirect blocks go
+ * to new_blocks[0..indirect_blks-1], the first data block to
+ * new_blocks[indirect_blks], and the data blocks that follow it are
+ * contiguous. Returns the number of data blocks allocated.
+ */
+static int ext2_alloc_blocks(struct inode *inode, ext2_fsblk_t goal,
+                             int indirect_blks, int blks,
+                             ext2_fsblk_t new_blocks[4], int *err)
+{
+	int target, i;
+	unsigned long count = 0;
+	int index = 0;
+	ext2_fsblk_t current_block = 0;
+
+	target = blks + indirect_blks;
+	while (1) {
+		count = target;
+		current_block = ext2_new_blocks(inode, goal, &count, err);
+		if (*err)
+			goto failed_out;
+		inode->i_blocks += (count * inode->i_sb->s_blocksize) / 512;
+
+		target -= count;
+		//> The first blocks of each run go to the indirect blocks.
+		while (index < indirect_blks && count) {
+			new_blocks[index++] = current_block++;
+			count--;
+		}
+		if (count > 0)
+			break;
+		goal = current_block;
+	}
+
+	new_blocks[index] = current_block;
+	return count;
+
+failed_out:
+	for (i = 0; i < index; i++)
+		ext2_free_blocks(inode, new_blocks[i], 1);
+	return 0;
+}
+
+/*
+ * Allocates the missing part of the branch: indirect_blks new indirect
+ * blocks, zeroed and chained together, and *blks data blocks, hooked into
+ * the last of them. offsets are the offsets of the missing steps, starting
+ * with the one that branch[0] stands for. branch[0] is only filled in
+ * memory; ext2_splice_branch() attaches it to the tree.
+ * On success *blks is set to the number of data blocks allocated.
+ */
+static int ext2_alloc_branch(struct inode *inode, int indirect_blks,
+                             int *blks, ext2_fsblk_t goal, int *offsets,
+                             Indirect *branch)
+{
+	int blocksize = inode->i_sb->s_blocksize;
+	int i, n = 0;
+	int err = 0;
+	struct buffer_head *bh;
+	int num;
+	ext2_fsblk_t new_blocks[4];
+	ext2_fsblk_t current_block;
+
+	num = ext2_alloc_blocks(inode, goal, indirect_blks, *blks, new_blocks, &err);
+	if (err)
+		return err;
+
+	branch[0].key = cpu_to_le32(new_blocks[0]);
+	for (n = 1; n <= indirect_blks; n++) {
+		//> Zero the new block of pointers and hook the next step into it.
+		bh = sb_getblk(inode->i_sb, new_blocks[n - 1]);
+		if (unlikely(!bh)) {
+			err = -ENOMEM;
+			goto failed;
+		}
+		branch[n].bh = bh;
+		lock_buffer(bh);
+		memset(bh->b_data, 0, blocksize);
+		branch[n].p = (__le32 *)bh->b_data + offsets[n];
+		branch[n].key = cpu_to_le32(new_blocks[n]);
+		*branch[n].p = branch[n].key;
+		if (n == indirect_blks) {
+			current_block = new_blocks[n];
+			for (i = 1; i < num; i++)
+				*(branch[n].p + i) = cpu_to_le32(++current_block);
+		}
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty_inode(bh, inode);
+		if (S_ISDIR(inode->i_mode) && IS_DIRSYNC(inode))
+			sync_dirty_buffer(bh);
+	}
+	*blks = num;
+	return 0;
+
+failed:
+	for (i = 1; i < n; i++)
+		bforget(branch[i].bh);
+	for (i = 0; i < indirect_blks; i++)
+		ext2_free_blocks(inode, new_blocks[i], 1);
+	ext2_free_blocks(inode, new_blocks[i], num);
+	return err;
+}
+
+/*
+ * Attaches the branch built by ext2_alloc_branch() to the tree. If no
+ * indirect block was allocated (num == 0) the blks data blocks go straight
+ * into the slots that follow where->p.
+ */
+static void ext2_splice_branch(struct inode *inode, Indirect *where,
+                               int num, int blks)
+{
+	ext2_fsblk_t current_block;
+	int i;
+
+	*where->p = where->key;
+	if (num == 0 && blks > 1) {
+		current_block = le32_to_cpu(where->key) + 1;
+		for (i = 1; i < blks; i++)
+			*(where->p + i) = cpu_to_le32(current_block++);
+	}
+
+	if (where->bh)
+		mark_buffer_dirty_inode(where->bh, inode);
+	inode_set_ctime_current(inode);
+	mark_inode_dirty(inode);
+}
+
+/*
+ * Maps up to maxblocks blocks of the inode, starting at iblock, to the
+ * longest physically contiguous run on disk. The chain of indirect blocks
+ * is walked once per call and the run is taken from the block of pointers
+ * that is already in memory, so a large sequential file costs a metadata
+ * read per block of pointers rather than per data block.
+ * When create is set, the missing indirect blocks and the unmapped blocks
+ * from iblock on are allocated together, close to each other.
+ * The chain is read under the read side of the map lock of the inode, and
+ * the tree is only changed under its write side, like ext2_truncate_blocks()
+ * does.
+ * Returns the number of blocks mapped, setting *bno to the first one,
+ * 0 if iblock is a hole, or a negative error.
+ */
 static int ext2_get_blocks(struct inode *inode,
 			   sector_t iblock, unsigned long maxblocks,
 			   u32 *bno, bool *new, int create)
 {
-	struct ext2_inode_info *ei = EXT2_I(inode);
-	u32 block_no = 0;
+	struct rw_semaphore *sem = ext2_map_lock(inode);
+	int err;
+	int offsets[4];
+	Indirect chain[4];
+	Indirect *partial;
+	ext2_fsblk_t goal;
+	int indirect_blks;
+	int blocks_to_boundary = 0;
+	int depth;
+	int count = 0;
+	u32 first_block = 0;
+
+	if (ext2_inode_has_extents(inode))
+		return ext2_ext_get_blocks(inode, iblock, maxblocks, bno, new, create);
 
 	ext2_debug("looking for block: %llu of inode: %lu create: %d\n",
 	           iblock, inode->i_ino, create);
 
-	/* We currently only support direct blocks. */
-	if (iblock >= EXT2_NDIR_BLOCKS)
+	if (maxblocks == 0)
+		maxblocks = 1;
+	depth = ext2_block_to_path(inode, iblock, offsets, &blocks_to_boundary);
+	if (depth == 0)
 		return -EIO;
 
-	block_no = le32_to_cpu(ei->i_data[iblock]);
-	if (block_no > 0) {
-		/* Block found, just return its number. */
-		*bno = block_no;
-		ext2_debug("found block %llu of inode %lu: %u\n",
-		           iblock, inode->i_ino, block_no);
-		return 1;
-	} else if (!create) {
-		/* Not found and the kernel did not ask from us to create it. */
+	down_read(sem);
+	partial = ext2_get_branch(inode, depth, offsets, chain, &err);
+	if (!partial) {
+		/* Block found, extend the mapping while the blocks are contiguous. */
+		count = ext2_mapped_run(&chain[depth - 1], maxblocks, blocks_to_boundary);
+		up_read(sem);
+		first_block = le32_to_cpu(chain[depth - 1].key);
+		ext2_debug("found blocks %llu-%llu of inode %lu: %u\n",
+		           iblock, iblock + count - 1, inode->i_ino, first_block);
+		goto got_it;
+	}
+	up_read(sem);
+
+	if (!create || err) {
+		/* Not found and the kernel did not ask from us to create it,
+		 * or an indirect block could not be read. */
 		*bno = 0;
-		ext2_debug("could not find block %llu of inode %lu: %u\n",
-		           iblock, inode->i_ino, block_no);
-		return 0;
-	} else {
-		/* Not found and the kernel asks from us to create (allocate) it. */
-		ext2_fsblk_t resb;
-		unsigned long count = 1;
-		int errp;
+		ext2_debug("could not find block %llu of inode %lu: %d\n",
+		           iblock, inode->i_ino, err);
+		goto cleanup;
+	}
+
+	/* Not found and the kernel asks from us to create (allocate) it,
+	 * along with the rest of the hole that follows, up to maxblocks. */
+	down_write(sem);
+	if (!verify_chain(chain, partial)) {
+		/* Someone changed the branch while it was unlocked, maybe
+		 * filling the hole or truncating it away: read it again. */
+		while (partial > chain) {
+			brelse(partial->bh);
+			partial--;
+		}
+		partial = ext2_get_branch(inode, depth, offsets, chain, &err);
+		if (!partial) {
+			count = ext2_mapped_run(&chain[depth - 1], maxblocks,
+			                        blocks_to_boundary);
+			up_write(sem);
+			first_block = le32_to_cpu(chain[depth - 1].key);
+			goto got_it;
+		}
+		if (err) {
+			up_write(sem);
+			*bno = 0;
+			goto cleanup;
+		}
+	}
 
-		resb = ext2_new_blocks(inode, &count, &errp);
-		if (errp < 0)
-			return errp;
+	goal = ext2_find_goal(inode, partial);
+	indirect_blks = (chain + depth) - partial - 1;
+	count = ext2_blks_to_allocate(partial, indirect_blks, maxblocks,
+	                              blocks_to_boundary);
+	err = ext2_alloc_branch(inode, indirect_blks, &count, goal,
+	                        offsets + (partial - chain), partial);
+	if (err) {
+		up_write(sem);
+		goto cleanup;
+	}
 
-		ei->i_data[iblock] = resb;
-		inode->i_blocks += (count * inode->i_sb->s_blocksize) / 512 ;
-		mark_inode_dirty(inode);
-		*bno = resb;
-		*new = true;
-		ext2_debug("allocated new block %llu for inode %lu: %lu"
-		           " inode->i_blocks: %llu count: %lu\n",
-		           iblock, inode->i_ino, resb, inode->i_blocks, count);
-		return count;
+	ext2_splice_branch(inode, partial, indirect_blks, count);
+	up_write(sem);
+	*new = true;
+	first_block = le32_to_cpu(chain[depth - 1].key);
+	ext2_debug("allocated new blocks %llu-%llu for inode %lu: %u"
+	           " (%d indirect) inode->i_blocks: %llu\n",
+	           iblock, iblock + count - 1, inode->i_ino, first_block,
+	           indirect_blks, inode->i_blocks);
+
+got_it:
+	*bno = first_block;
+	err = count;
+	partial = chain + depth - 1;
+cleanup:
+	while (partial > chain) {
+		brelse(partial->bh);
+		partial--;
 	}
+	return err;
 }
 
 /*
@@ -209,10 +587,116 @@ static inline void ext2_free_data(struct inode *inode, __le32 *p, __le32 *q)
 	}
 }
 
-/* Truncate the inode to the size of `offset` */
+/*
+ * Finds the part of the branch to iblock (whose path is offsets[0..depth-1])
+ * that the truncate must keep: the indirect blocks that still hold pointers
+ * before the path. The first step after it, if it belongs entirely to the
+ * truncated tail, is detached from the tree and returned in *top, so that
+ * the caller frees it as a whole subtree.
+ * Returns the last step to keep; the caller frees the slots after its p in
+ * each step of the chain up to it, and releases their buffer heads.
+ */
+static Indirect *ext2_find_shared(struct inode *inode, int depth,
+                                  int offsets[4], Indirect chain[4],
+                                  __le32 *top)
+{
+	Indirect *partial, *p;
+	int k, err;
+
+	*top = 0;
+	for (k = depth; k > 1 && !offsets[k - 1]; k--)
+		;
+	partial = ext2_get_branch(inode, k, offsets, chain, &err);
+	if (!partial)
+		partial = chain + k - 1;
+
+	for (p = partial; p > chain && all_zeroes((__le32 *)p->bh->b_data, p->p); p--)
+		;
+	/*
+	 * p is the last block that must survive. If the rest of the branch
+	 * hangs from a block of pointers that we keep, it is freed along with
+	 * the rest of that block by moving p back by one slot.
+	 */
+	if (p == chain + k - 1 && p > chain) {
+		p->p--;
+	} else {
+		*top = *p->p;
+		*p->p = 0;
+	}
+
+	while (partial > p) {
+		brelse(partial->bh);
+		partial--;
+	}
+	return partial;
+}
+
+/**
+ *	ext2_free_branches - free an array of branches
+ *	@inode:	inode we are dealing with
+ *	@p:	array of block numbers
+ *	@q:	pointer immediately past the end of array
+ *	@depth:	depth of the branches to free
+ *
+ *	We are freeing all blocks referred from these branches (numbers are
+ *	stored as little-endian 32-bit), the indirect blocks along with the
+ *	data blocks below them. Contiguous blocks are freed in one go.
+ */
+static void ext2_free_branches(struct inode *inode, __le32 *p, __le32 *q, int depth)
+{
+	struct buffer_head *bh;
+	unsigned long block_to_free = 0, count = 0;
+	unsigned long nr;
+
+	if (!depth) {
+		ext2_free_data(inode, p, q);
+		return;
+	}
+
+	for ( ; p < q ; p++) {
+		nr = le32_to_cpu(*p);
+		if (!nr)
+			continue;
+		*p = 0;
+		bh = sb_bread(inode->i_sb, nr);
+		if (!bh) {
+			ext2_error(inode->i_sb, __func__, "Read failure, inode=%lu, block=%lu",
+			           inode->i_ino, nr);
+			continue;
+		}
+		ext2_free_branches(inode, (__le32 *)bh->b_data,
+		                   (__le32 *)bh->b_data + EXT2_ADDR_PER_BLOCK(inode->i_sb),
+		                   depth - 1);
+		bforget(bh);
+
+		/* accumulate the indirect blocks to free if they're contiguous */
+		if (count > 0 && block_to_free + count == nr) {
+			count++;
+			continue;
+		}
+		if (count > 0)
+			ext2_free_blocks(inode, block_to_free, count);
+		block_to_free = nr;
+		count = 1;
+	}
+	if (count > 0)
+		ext2_free_blocks(inode, block_to_free, count);
+}
+
+/*
+ * Truncate the inode to the size of `offset`. The tree is changed under
+ * the write side of the map lock of the inode, as in ext2_get_blocks().
+ */
 static void ext2_truncate_blocks(struct inode *inode, loff_t offset)
 {
+	struct rw_semaphore *sem = ext2_map_lock(inode);
 	__le32 *i_data = EXT2_I(inode)->i_data;
+	int addr_per_block = EXT2_ADDR_PER_BLOCK(inode->i_sb);
+	int offsets[4];
+	Indirect chain[4];
+	Indirect *partial;
+	__le32 nr = 0;
+	int n;
 	long iblock;
 	unsigned blocksize;
 
@@ -225,7 +709,71 @@ static void ext2_truncate_blocks(struct inode *inode, loff_t offset)
 	blocksize = inode->i_sb->s_blocksize;
 	iblock = (offset + blocksize-1) >> EXT2_BLOCK_SIZE_BITS(inode->i_sb);
 
-	ext2_free_data(inode, &i_data[iblock], &i_data[EXT2_NDIR_BLOCKS]);
+	if (ext2_inode_has_extents(inode)) {
+		ext2_ext_truncate(inode, iblock);
+		return;
+	}
+
+	n = ext2_block_to_path(inode, iblock, offsets, NULL);
+	if (n == 0)
+		return;
+
+	down_write(sem);
+	if (n == 1) {
+		ext2_free_data(inode, i_data + offsets[0], i_data + EXT2_NDIR_BLOCKS);
+		goto do_indirects;
+	}
+
+	partial = ext2_find_shared(inode, n, offsets, chain, &nr);
+	/* Kill the top of the shared branch (already detached). */
+	if (nr) {
+		if (partial == chain)
+			mark_inode_dirty(inode);
+		else
+			mark_buffer_dirty_inode(partial->bh, inode);
+		ext2_free_branches(inode, &nr, &nr + 1, (chain + n - 1) - partial);
+	}
+	/* Clear the ends of the indirect blocks on the shared branch. */
+	while (partial > chain) {
+		ext2_free_branches(inode, partial->p + 1,
+		                   (__le32 *)partial->bh->b_data + addr_per_block,
+		                   (chain + n - 1) - partial);
+		mark_buffer_dirty_inode(partial->bh, inode);
+		brelse(partial->bh);
+		partial--;
+	}
+
+do_indirects:
+	/* Kill the remaining (whole) subtrees. */
+	switch (offsets[0]) {
+	default:
+		nr = i_data[EXT2_IND_BLOCK];
+		if (nr) {
+			i_data[EXT2_IND_BLOCK] = 0;
+			mark_inode_dirty(inode);
+			ext2_free_branches(inode, &nr, &nr + 1, 1);
+		}
+		fallthrough;
+	case EXT2_IND_BLOCK:
+		nr = i_data[EXT2_DIND_BLOCK];
+		if (nr) {
+			i_data[EXT2_DIND_BLOCK] = 0;
+			mark_inode_dirty(inode);
+			ext2_free_branches(inode, &nr, &nr + 1, 2);
+		}
+		fallthrough;
+	case EXT2_DIND_BLOCK:
+		nr = i_data[EXT2_TIND_BLOCK];
+		if (nr) {
+			i_data[EXT2_TIND_BLOCK] = 0;
+			mark_inode_dirty(inode);
+			ext2_free_branches(inode, &nr, &nr + 1, 3);
+		}
+		break;
+	case EXT2_TIND_BLOCK:
+		;
+	}
+	up_write(sem);
 }
 
 static struct ext2_inode *ext2_get_inode(struct super_block *sb, ino_t ino,
@@ -383,6 +931,15 @@ struct inode *ext2_iget(struct super_block *sb, unsigned long ino)
 	for (n = 0; n < EXT2_N_BLOCKS; n++)
 		ei->i_data[n] = raw_inode->i_block[n];
 
+	if (ext2_inode_has_extents(inode) &&
+	    (!ext2_has_extents(sb) || ext2_ext_check_inode(inode))) {
+		ext2_error(sb, __func__, "bad extent tree in inode %lu", ino);
+		ret = -EUCLEAN;
+		brelse(bh);
+		iget_failed(inode);
+		return ERR_PTR(ret);
+	}
+
 	brelse(bh);
 	unlock_new_inode(inode);
 	return inode;
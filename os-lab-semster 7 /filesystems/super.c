@@ -16,6 +16,7 @@
 #include <linux/seq_file.h>
 #include <linux/iversion.h>
 #include "ext2.h"
+#include "ext2_extents.h"
 
 // Necessary forward declarations
 static void ext2_sync_super(struct super_block *, struct ext2_super_block *, int);
@@ -216,6 +217,25 @@ static int ext2_check_descriptors(struct super_block *sb)
 	return 1;
 }
 
+/*
+ * The largest file that the block tree can map with blocks of 2^bits bytes:
+ * direct, single, double and triple indirect blocks. It is capped at 2GiB-1
+ * since i_size is kept in 32 bits and we do not support LARGE_FILE.
+ */
+static loff_t ext2_max_size(int bits)
+{
+	loff_t res = EXT2_NDIR_BLOCKS;
+
+	res += 1LL << (bits - 2);
+	res += 1LL << (2 * (bits - 2));
+	res += 1LL << (3 * (bits - 2));
+	res <<= bits;
+	if (res > 0x7fffffff)
+		res = 0x7fffffff;
+
+	return res;
+}
+
 static unsigned long descriptor_loc(struct super_block *sb,
                                     unsigned long logic_sb_block, int nr)
 {
@@ -561,8 +581,13 @@ static int ext2_fill_super(struct super_block *sb, void *data, int silent)
 
 	sbi->s_mount_opt = mount_opt;
 
-	/* In ext2-lite we do not support any set of features. */
-	if (es->s_feature_ro_compat || es->s_feature_compat || es->s_feature_incompat) {
+	/*
+	 * In ext2-lite the only features we support are extent-mapped inodes
+	 * and hash-indexed directories.
+	 */
+	if (es->s_feature_ro_compat ||
+	    (es->s_feature_compat & ~cpu_to_le32(EXT2_FEATURE_COMPAT_DIR_INDEX)) ||
+	    (es->s_feature_incompat & ~cpu_to_le32(EXT2_FEATURE_INCOMPAT_EXTENTS))) {
 		ext2_msg(sb, KERN_ERR, "error: couldn't mount because of unsupported features");
 		goto failed_mount;
 	}
@@ -594,8 +619,7 @@ static int ext2_fill_super(struct super_block *sb, void *data, int silent)
 		}
 	}
 
- 	//> In ext2-lite we only currently support direct blocks.
-	sb->s_maxbytes = EXT2_NDIR_BLOCKS << sb->s_blocksize_bits;
+	sb->s_maxbytes = ext2_max_size(sb->s_blocksize_bits);
 	sb->s_max_links = EXT2_LINK_MAX;
 	sb->s_time_min = S32_MIN;
 	sb->s_time_max = S32_MAX;
@@ -764,6 +788,8 @@ static int __init init_ext2_fs(void)
 	if (err)
 		return err;
 
+	ext2_ext_init();
+
 	/* Register ext2-lite filesystem in the kernel */
 	/* If an error occurs remember to call destroy_inodecache() */
 	/* ? */
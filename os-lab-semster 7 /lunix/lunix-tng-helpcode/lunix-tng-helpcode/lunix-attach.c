@@ -32,6 +32,7 @@
 #include <sys/ioctl.h>
 
 #include "lunix.h"
+#include "lunix-ldisc.h"
 
 #ifndef _PATH_LOCKD
 #define _PATH_LOCKD "/var/lock" /* lock files */
@@ -476,21 +477,50 @@ static void sig_catch(int sig)
 	exit(0);
 }
 
+/* Set the sensor namespace of the TTY. */
+static int tty_set_sensor_base(unsigned int base)
+{
+	int saved_errno;
+
+	if (ioctl(tty_fd, LUNIX_LDISC_IOC_SET_BASE, &base) < 0) {
+		saved_errno = errno;
+		perror("set sensor base: failed to set sensor base");
+		return -saved_errno;
+	}
+
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
-	if (argc != 2) {
-		fprintf(stderr,
-		        "Usage: %s tty_line\n"
-		        "where tty_line is the TTY on which to set the Lunix line discipline.\n\n",
-		        argv[0]);
-		exit(1);
+	int opt;
+	char *end;
+	unsigned long base = 0;
+
+	while ((opt = getopt(argc, argv, "b:")) != -1) {
+		switch (opt) {
+		case 'b':
+			base = strtoul(optarg, &end, 0);
+			if (*optarg == '\0' || *end != '\0')
+				goto usage;
+			break;
+		default:
+			goto usage;
+		}
 	}
+	if (optind != argc - 1)
+		goto usage;
 
-	if (tty_open(argv[1]) < 0)
+	if (tty_open(argv[optind]) < 0)
 		return 1;
 
-	fprintf(stderr, "Line discipline set on %s, press ^C to release the TTY...\n",
-		argv[1]);
+	if (base && tty_set_sensor_base(base) < 0) {
+		tty_close();
+		return 1;
+	}
+
+	fprintf(stderr, "Line discipline set on %s [sensor base %lu], press ^C to release the TTY...\n",
+		argv[optind], base);
 
 	(void) signal(SIGHUP, sig_catch);
 	(void) signal(SIGINT, sig_catch);
@@ -502,4 +532,12 @@ int main(int argc, char *argv[])
 
 	/* Unreachable */
 	return 100;
+
+usage:
+	fprintf(stderr,
+	        "Usage: %s [-b sensor_base] tty_line\n"
+	        "where tty_line is the TTY on which to set the Lunix line discipline.\n"
+	        "Node id N on this TTY updates sensor (sensor_base + N - 1) [default: 0].\n\n",
+	        argv[0]);
+	exit(1);
 }
@@ -0,0 +1,653 @@
+/*
+ * lunix-bench.c
+ *
+ * Userspace microbenchmarks for Lunix:TNG.
+ *
+ * Each subcommand models one hot path of the driver closely enough
+ * to compare the alternatives that were considered for it, without
+ * having to load the module:
+ *
+ * layout: updates of the sensor structures by a number of threads,
+ *         with the sensors packed in an array, as they used to be,
+ *         or each one starting on a cache line of its own.
+ *
+ * convert: conversion of raw measurements to milli-units, with the
+ *         compact tables of lunix-lookup.h and the light formula, as
+ *         lunix_msr_convert() does, or with 64K-entry tables of longs
+ *         indexed by the raw value, as the driver used to.
+ *
+ * read:   read() throughput of a device node, from a number of threads
+ *         sharing one open file or opening the node once each. This one
+ *         needs the module loaded and fed, e.g. with lunix-gen.
+ *
+ */
+
+#define _GNU_SOURCE             /* pthread_setaffinity_np() */
+
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "lunix.h"
+#include "lunix-lookup.h"
+
+#define BENCH_CACHELINE     64
+#define BENCH_ALIGN(size)   (((size) + BENCH_CACHELINE - 1) & ~(size_t)(BENCH_CACHELINE - 1))
+
+static const char *bench_prog;
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_ulong(const char *s, unsigned long min, unsigned long max,
+                       unsigned long *val)
+{
+	char *end;
+
+	*val = strtoul(s, &end, 0);
+	return *s != '\0' && *end == '\0' && *val >= min && *val <= max;
+}
+
+/* Spread the threads over the CPUs, the way the work items would be */
+static void bench_pin(pthread_t thread, unsigned long i)
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t set;
+
+	if (ncpus < 1)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(i % ncpus, &set);
+	(void) pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+/*
+ * layout
+ *
+ * struct bench_sensor mirrors the fields of struct lunix_sensor_struct
+ * on a 64-bit kernel without lock debugging: a spinlock is a 32-bit word
+ * and a waitqueue head is a spinlock and a list head. Every update does
+ * what lunix_sensor_update() does to the structure itself: take the lock,
+ * add a sample to the aggregates of each measurement, drop the lock and
+ * look at the waitqueue. The measurement pages are left out, since they
+ * were page-sized allocations of their own in both layouts.
+ */
+struct bench_window {
+	uint64_t start_ns;
+	uint32_t count;
+	int32_t min;
+	int32_t max;
+	int64_t sum;
+};
+
+struct bench_sensor {
+	unsigned int id;
+	void *msr_data[N_LUNIX_MSR];
+	uint32_t lock;
+	struct {
+		uint64_t window_ns;
+		struct bench_window cur;
+		struct bench_window last;
+	} aggr[N_LUNIX_MSR];
+	struct {
+		uint32_t lock;
+		void *next, *prev;
+	} wq;
+};
+
+struct bench_layout {
+	unsigned char *base;
+	size_t stride;
+	unsigned long sensors;
+	unsigned long threads;
+	unsigned long updates;
+	pthread_barrier_t barrier;
+};
+
+struct bench_layout_thread {
+	struct bench_layout *layout;
+	unsigned long index;
+	pthread_t thread;
+};
+
+static struct bench_sensor *bench_sensor(struct bench_layout *l, unsigned long i)
+{
+	return (struct bench_sensor *)(l->base + i * l->stride);
+}
+
+static void bench_spin_lock(uint32_t *lock)
+{
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+		while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+			sched_yield();
+}
+
+static void bench_spin_unlock(uint32_t *lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+static void bench_sensor_update(struct bench_sensor *s, uint64_t now,
+                                const int32_t *value)
+{
+	struct bench_window *w;
+	int i;
+
+	bench_spin_lock(&s->lock);
+	for (i = 0; i < N_LUNIX_MSR; i++) {
+		w = &s->aggr[i].cur;
+		if (now - w->start_ns >= s->aggr[i].window_ns) {
+			s->aggr[i].last = *w;
+			memset(w, 0, sizeof(*w));
+			w->start_ns = now;
+		}
+		if (!w->count || value[i] < w->min)
+			w->min = value[i];
+		if (!w->count || value[i] > w->max)
+			w->max = value[i];
+		w->sum += value[i];
+		w->count++;
+	}
+	bench_spin_unlock(&s->lock);
+
+	/* wake_up_interruptible() on a waitqueue nobody sleeps on */
+	if (__atomic_load_n(&s->wq.next, __ATOMIC_RELAXED) != &s->wq.next)
+		bench_spin_lock(&s->wq.lock), bench_spin_unlock(&s->wq.lock);
+}
+
+/*
+ * Thread t owns the sensors t, t + threads, ..., as a sensor is only ever
+ * updated by one packet at a time, so that neighbours in the array always
+ * belong to different threads.
+ */
+static void *bench_layout_thread(void *arg)
+{
+	struct bench_layout_thread *t = arg;
+	struct bench_layout *l = t->layout;
+	unsigned long i, s;
+	int32_t value[N_LUNIX_MSR];
+
+	pthread_barrier_wait(&l->barrier);
+	s = t->index;
+	for (i = 0; i < l->updates; i++) {
+		value[BATT] = i & 0x3FF;
+		value[TEMP] = (i * 3) & 0x3FF;
+		value[LIGHT] = (i * 257) & 0xFFFF;
+		bench_sensor_update(bench_sensor(l, s), i, value);
+		s += l->threads;
+		if (s >= l->sensors)
+			s = t->index;
+	}
+	return NULL;
+}
+
+static double bench_layout_run(struct bench_layout *l)
+{
+	struct bench_layout_thread *t;
+	unsigned long i;
+	double start;
+	int m;
+
+	if (!(t = calloc(l->threads, sizeof(*t))))
+		return -1;
+	memset(l->base, 0, l->sensors * l->stride);
+	for (i = 0; i < l->sensors; i++) {
+		bench_sensor(l, i)->id = i;
+		for (m = 0; m < N_LUNIX_MSR; m++)
+			bench_sensor(l, i)->aggr[m].window_ns = 1000;
+		bench_sensor(l, i)->wq.next = &bench_sensor(l, i)->wq.next;
+		bench_sensor(l, i)->wq.prev = &bench_sensor(l, i)->wq.next;
+	}
+
+	pthread_barrier_init(&l->barrier, NULL, l->threads + 1);
+	for (i = 0; i < l->threads; i++) {
+		t[i].layout = l;
+		t[i].index = i;
+		if (pthread_create(&t[i].thread, NULL, bench_layout_thread, &t[i])) {
+			perror("pthread_create");
+			exit(1);
+		}
+		bench_pin(t[i].thread, i);
+	}
+	pthread_barrier_wait(&l->barrier);
+	start = bench_now();
+	for (i = 0; i < l->threads; i++)
+		pthread_join(t[i].thread, NULL);
+	start = bench_now() - start;
+
+	pthread_barrier_destroy(&l->barrier);
+	free(t);
+	return start;
+}
+
+static int bench_layout(int argc, char *argv[])
+{
+	struct bench_layout l;
+	unsigned long rounds = 5, r, total;
+	double secs, best[2];
+	int opt, packed;
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	l.sensors = 16;
+	l.threads = ncpus > 1 ? ncpus : 2;
+	l.updates = 2000000;
+	while ((opt = getopt(argc, argv, "s:t:n:r:")) != -1) {
+		switch (opt) {
+		case 's':
+			if (!bench_ulong(optarg, 1, 65535, &l.sensors))
+				goto usage;
+			break;
+		case 't':
+			if (!bench_ulong(optarg, 1, 1024, &l.threads))
+				goto usage;
+			break;
+		case 'n':
+			if (!bench_ulong(optarg, 1, ~0UL, &l.updates))
+				goto usage;
+			break;
+		case 'r':
+			if (!bench_ulong(optarg, 1, 1000, &rounds))
+				goto usage;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc || l.threads > l.sensors)
+		goto usage;
+
+	/* Room for either layout, on a cache line boundary */
+	if (!(l.base = aligned_alloc(BENCH_CACHELINE,
+	                             l.sensors * BENCH_ALIGN(sizeof(struct bench_sensor))))) {
+		perror("aligned_alloc");
+		return 1;
+	}
+
+	printf("%lu sensors, %lu threads, %ld CPUs, %lu updates per thread\n",
+	       l.sensors, l.threads, ncpus, l.updates);
+	best[0] = best[1] = 0;
+	for (r = 0; r < rounds; r++) {
+		for (packed = 0; packed < 2; packed++) {
+			l.stride = packed ? sizeof(struct bench_sensor) :
+			           BENCH_ALIGN(sizeof(struct bench_sensor));
+			secs = bench_layout_run(&l);
+			if (secs < 0) {
+				perror("calloc");
+				return 1;
+			}
+			if (!best[packed] || secs < best[packed])
+				best[packed] = secs;
+		}
+	}
+
+	total = l.threads * l.updates;
+	for (packed = 1; packed >= 0; packed--)
+		printf("%-8s stride %3zu bytes: %7.2f Mupdates/s, %6.1f ns/update\n",
+		       packed ? "packed" : "aligned",
+		       packed ? sizeof(struct bench_sensor) :
+		       BENCH_ALIGN(sizeof(struct bench_sensor)),
+		       total / best[packed] / 1e6, best[packed] * 1e9 / total);
+
+	free(l.base);
+	return 0;
+
+usage:
+	fprintf(stderr,
+	        "Usage: %s layout [-s sensors] [-t threads] [-n updates] [-r rounds]\n"
+	        "Update sensors [default: 16] from threads [default: the CPUs,\n"
+	        "at least 2], updates times each [default: 2000000], with the\n"
+	        "sensors packed in an array and on cache lines of their own.\n"
+	        "The best of rounds [default: 5] runs of each is reported.\n\n",
+	        bench_prog);
+	return 1;
+}
+
+/*
+ * convert
+ *
+ * The old tables are filled in from the new conversion, so both ways
+ * return the same values; only where they come from differs. Between
+ * batches of packets the caches can be polluted, the way the rest of
+ * the kernel would between two packets of a real sensor network, and
+ * only the conversions themselves are timed.
+ */
+#define BENCH_OLD_SIZE      65536
+#define BENCH_BATCH         64      /* Packets converted between pollutions */
+
+static long *bench_old_voltage, *bench_old_temperature, *bench_old_light;
+static volatile long bench_sink;
+
+static long bench_convert_none(enum lunix_msr_enum type, uint32_t raw)
+{
+	return raw;
+}
+
+static long bench_convert_new(enum lunix_msr_enum type, uint32_t raw)
+{
+	switch (type) {
+	case BATT:
+		return lookup_voltage[raw < LUNIX_LOOKUP_SIZE ? raw : LUNIX_LOOKUP_SIZE - 1];
+	case TEMP:
+		return lookup_temperature[raw < LUNIX_LOOKUP_SIZE ? raw : LUNIX_LOOKUP_SIZE - 1];
+	case LIGHT:
+		return (uint64_t)(raw < 0xFFFF ? raw : 0xFFFF) * LUNIX_LIGHT_MUL /
+		       LUNIX_LIGHT_DIV;
+	default:
+		return 0;
+	}
+}
+
+static long bench_convert_old(enum lunix_msr_enum type, uint32_t raw)
+{
+	switch (type) {
+	case BATT:
+		return bench_old_voltage[raw];
+	case TEMP:
+		return bench_old_temperature[raw];
+	case LIGHT:
+		return bench_old_light[raw];
+	default:
+		return 0;
+	}
+}
+
+static int bench_convert_init(void)
+{
+	uint32_t i;
+
+	bench_old_voltage = malloc(BENCH_OLD_SIZE * sizeof(long));
+	bench_old_temperature = malloc(BENCH_OLD_SIZE * sizeof(long));
+	bench_old_light = malloc(BENCH_OLD_SIZE * sizeof(long));
+	if (!bench_old_voltage || !bench_old_temperature || !bench_old_light)
+		return -1;
+	for (i = 0; i < BENCH_OLD_SIZE; i++) {
+		bench_old_voltage[i] = bench_convert_new(BATT, i);
+		bench_old_temperature[i] = bench_convert_new(TEMP, i);
+		bench_old_light[i] = bench_convert_new(LIGHT, i);
+	}
+	return 0;
+}
+
+/*
+ * Converts every packet of raw, BENCH_BATCH at a time, touching pollute
+ * bytes of scratch in between. Returns the seconds spent converting.
+ */
+static double bench_convert_run(long (*convert)(enum lunix_msr_enum, uint32_t),
+                                const uint16_t *raw, unsigned long packets,
+                                volatile unsigned char *scratch, size_t pollute)
+{
+	unsigned long p, i;
+	size_t j;
+	double start, secs = 0;
+	long sum = 0;
+
+	for (p = 0; p < packets; p += BENCH_BATCH) {
+		for (j = 0; j < pollute; j += BENCH_CACHELINE)
+			scratch[j]++;
+		start = bench_now();
+		for (i = p; i < p + BENCH_BATCH && i < packets; i++) {
+			sum += convert(BATT, raw[i * N_LUNIX_MSR + BATT]);
+			sum += convert(TEMP, raw[i * N_LUNIX_MSR + TEMP]);
+			sum += convert(LIGHT, raw[i * N_LUNIX_MSR + LIGHT]);
+		}
+		secs += bench_now() - start;
+	}
+	bench_sink += sum;
+	return secs;
+}
+
+static int bench_convert(int argc, char *argv[])
+{
+	unsigned long packets = 1000000, pollute_kb = 0, rounds = 5, r, i;
+	unsigned char *scratch = NULL;
+	uint16_t *raw;
+	uint32_t x = 2463534242u;
+	double secs, empty, best[2];
+	int opt, old;
+
+	while ((opt = getopt(argc, argv, "n:p:r:")) != -1) {
+		switch (opt) {
+		case 'n':
+			if (!bench_ulong(optarg, BENCH_BATCH, ~0UL / N_LUNIX_MSR, &packets))
+				goto usage;
+			break;
+		case 'p':
+			if (!bench_ulong(optarg, 0, 1 << 20, &pollute_kb))
+				goto usage;
+			break;
+		case 'r':
+			if (!bench_ulong(optarg, 1, 1000, &rounds))
+				goto usage;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc)
+		goto usage;
+
+	if (bench_convert_init() < 0 ||
+	    !(raw = malloc(packets * N_LUNIX_MSR * sizeof(*raw))) ||
+	    (pollute_kb && !(scratch = calloc(pollute_kb, 1024)))) {
+		perror("malloc");
+		return 1;
+	}
+
+	/* Readings of the 10-bit ADC, and light over its whole range */
+	for (i = 0; i < packets; i++) {
+		x ^= x << 13, x ^= x >> 17, x ^= x << 5;
+		raw[i * N_LUNIX_MSR + BATT] = x & 0x3FF;
+		raw[i * N_LUNIX_MSR + TEMP] = (x >> 10) & 0x3FF;
+		raw[i * N_LUNIX_MSR + LIGHT] = x >> 16;
+	}
+
+	printf("%lu packets, %lu KB of pollution every %d packets\n",
+	       packets, pollute_kb, BENCH_BATCH);
+	best[0] = best[1] = empty = 0;
+	for (r = 0; r < rounds; r++) {
+		/* What the loop and the timing cost by themselves */
+		secs = bench_convert_run(bench_convert_none, raw, packets,
+		                         scratch, pollute_kb * 1024);
+		if (!empty || secs < empty)
+			empty = secs;
+		for (old = 0; old < 2; old++) {
+			secs = bench_convert_run(old ? bench_convert_old : bench_convert_new,
+			                         raw, packets, scratch, pollute_kb * 1024);
+			if (!best[old] || secs < best[old])
+				best[old] = secs;
+		}
+	}
+
+	for (old = 1; old >= 0; old--)
+		printf("%-8s tables %7zu bytes: %6.2f ns/measurement\n",
+		       old ? "64K" : "compact",
+		       old ? 3 * BENCH_OLD_SIZE * sizeof(long) :
+		       sizeof(lookup_voltage) + sizeof(lookup_temperature),
+		       (best[old] - empty) * 1e9 / (packets * N_LUNIX_MSR));
+
+	free(raw);
+	free(scratch);
+	return 0;
+
+usage:
+	fprintf(stderr,
+	        "Usage: %s convert [-n packets] [-p KB] [-r rounds]\n"
+	        "Convert the measurements of packets [default: 1000000] of random\n"
+	        "raw values, touching KB [default: 0] of memory every %d packets,\n"
+	        "with the compact tables and the old 64K-entry ones. The best of\n"
+	        "rounds [default: 5] runs of each is reported.\n\n",
+	        bench_prog, BENCH_BATCH);
+	return 1;
+}
+
+/*
+ * read
+ */
+struct bench_read {
+	const char *path;
+	int shared_fd;          /* -1 if every thread opens the node */
+	size_t len;
+	double secs;
+	volatile int stop;
+	pthread_barrier_t barrier;
+};
+
+struct bench_read_thread {
+	struct bench_read *bench;
+	unsigned long reads;
+	unsigned long long bytes;
+	pthread_t thread;
+};
+
+static void *bench_read_thread(void *arg)
+{
+	struct bench_read_thread *t = arg;
+	struct bench_read *b = t->bench;
+	char *buf;
+	ssize_t ret;
+	int fd = b->shared_fd;
+
+	if (!(buf = malloc(b->len))) {
+		perror("malloc");
+		exit(1);
+	}
+	if (fd < 0 && (fd = open(b->path, O_RDONLY)) < 0) {
+		perror(b->path);
+		exit(1);
+	}
+
+	pthread_barrier_wait(&b->barrier);
+	while (!b->stop) {
+		ret = read(fd, buf, b->len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			exit(1);
+		}
+		t->reads++;
+		t->bytes += ret;
+	}
+
+	if (fd != b->shared_fd)
+		close(fd);
+	free(buf);
+	return NULL;
+}
+
+static int bench_read(int argc, char *argv[])
+{
+	struct bench_read b;
+	struct bench_read_thread *t;
+	unsigned long threads = 1, secs = 5, len = 4096, i, reads = 0;
+	unsigned long long bytes = 0;
+	double elapsed;
+	int opt, shared = 0;
+
+	while ((opt = getopt(argc, argv, "t:d:b:s")) != -1) {
+		switch (opt) {
+		case 't':
+			if (!bench_ulong(optarg, 1, 1024, &threads))
+				goto usage;
+			break;
+		case 'd':
+			if (!bench_ulong(optarg, 1, 3600, &secs))
+				goto usage;
+			break;
+		case 'b':
+			if (!bench_ulong(optarg, 1, 1 << 20, &len))
+				goto usage;
+			break;
+		case 's':
+			shared = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1)
+		goto usage;
+
+	b.path = argv[optind];
+	b.len = len;
+	b.stop = 0;
+	b.shared_fd = -1;
+	if (shared && (b.shared_fd = open(b.path, O_RDONLY)) < 0) {
+		perror(b.path);
+		return 1;
+	}
+	if (!(t = calloc(threads, sizeof(*t)))) {
+		perror("calloc");
+		return 1;
+	}
+
+	pthread_barrier_init(&b.barrier, NULL, threads + 1);
+	for (i = 0; i < threads; i++) {
+		t[i].bench = &b;
+		if (pthread_create(&t[i].thread, NULL, bench_read_thread, &t[i])) {
+			perror("pthread_create");
+			return 1;
+		}
+		bench_pin(t[i].thread, i);
+	}
+	pthread_barrier_wait(&b.barrier);
+	elapsed = bench_now();
+	sleep(secs);
+	b.stop = 1;
+	elapsed = bench_now() - elapsed;
+
+	/* Blocked readers only notice once the next sample arrives */
+	for (i = 0; i < threads; i++) {
+		pthread_join(t[i].thread, NULL);
+		reads += t[i].reads;
+		bytes += t[i].bytes;
+	}
+
+	printf("%s: %lu threads, %s, %lu byte reads\n", b.path, threads,
+	       shared ? "one shared open file" : "an open file each", len);
+	printf("%.0f reads/s, %.1f KB/s\n", reads / elapsed, bytes / elapsed / 1024);
+
+	pthread_barrier_destroy(&b.barrier);
+	if (b.shared_fd >= 0)
+		close(b.shared_fd);
+	free(t);
+	return 0;
+
+usage:
+	fprintf(stderr,
+	        "Usage: %s read [-t threads] [-s] [-d seconds] [-b bytes] device\n"
+	        "Read device from threads [default: 1], bytes [default: 4096] at\n"
+	        "a time, for seconds [default: 5]. The threads open the device\n"
+	        "once each, or share one open file with -s.\n\n",
+	        bench_prog);
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	bench_prog = argv[0];
+	if (argc >= 2 && !strcmp(argv[1], "layout"))
+		return bench_layout(argc - 1, argv + 1);
+	if (argc >= 2 && !strcmp(argv[1], "convert"))
+		return bench_convert(argc - 1, argv + 1);
+	if (argc >= 2 && !strcmp(argv[1], "read"))
+		return bench_read(argc - 1, argv + 1);
+
+	fprintf(stderr,
+	        "Usage: %s layout|convert|read [options]\n"
+	        "Run a Lunix:TNG microbenchmark, see %s <benchmark> -h.\n\n",
+	        argv[0], argv[0]);
+	return 1;
+}
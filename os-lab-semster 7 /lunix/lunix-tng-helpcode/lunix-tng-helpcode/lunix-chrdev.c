@@ -17,25 +17,36 @@
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/sched.h>
+#include <linux/sched/signal.h>
 #include <linux/ioctl.h>
 #include <linux/types.h>
+#include <linux/kfifo.h>
+#include <linux/jiffies.h>
+#include <linux/uio.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/mmzone.h>
 #include <linux/vmalloc.h>
 #include <linux/spinlock.h>
+#include <linux/rculist.h>
 
 #include <asm/io.h>
 
 #include "lunix.h"
 #include "lunix-chrdev.h"
-#include "lunix-lookup.h"
 
 /*
  * Global data
  */
 struct cdev lunix_chrdev_cdev;
 
+/*
+ * Open instances of the "all sensors" node. Walked under RCU
+ * by the line discipline, modified under lunix_chrdev_all_lock.
+ */
+static LIST_HEAD(lunix_chrdev_all_list);
+static DEFINE_SPINLOCK(lunix_chrdev_all_lock);
+
 /*
  * Just a quick [unlocked] check to see if the cached
  * chrdev state needs to be updated from sensor measurements.
@@ -53,14 +64,121 @@ static int lunix_chrdev_state_needs_refresh(struct lunix_chrdev_state_struct *st
 	/* ? */
 
     /* MY CODE */
-    spin_lock(&sensor->lock);
-    uint32_t last_update = sensor->msr_data[state->type]->last_update;
-    spin_unlock(&sensor->lock);
+    // The generation of the page changes with every update, even within
+    // the same second. A single aligned word, no need to lock or retry
+    uint32_t seq = READ_ONCE(sensor->msr_data[state->type]->seq);
 
-	return state->buf_timestamp != last_update; 
+	return state->cursor != seq;
     /* END OF MY CODE */
 }
 
+/*
+ * Copies the sample at *pos, or the next one still in the sensor
+ * ring, to sample[] and advances *pos past it. pos is either the
+ * cursor of the open file or a copy of it, to be committed once the
+ * sample has reached the reader. If text is given and the sample is
+ * the most recent one, its pre-rendered text is copied there too and
+ * its length returned, otherwise 0 is returned.
+ * Must be called with the character device state lock held.
+ */
+static int lunix_chrdev_state_fetch(struct lunix_chrdev_state_struct *state,
+                                    uint32_t *pos, uint32_t *sample, char *text)
+{
+    struct lunix_msr_data_struct *msr = state->sensor->msr_data[state->type];
+    uint32_t start, seq, cursor;
+    int text_len;
+
+    // Copy over under the page seqcount, retrying if the sensor was updated meanwhile
+    do {
+        start = lunix_msr_read_begin(msr);
+
+        seq = msr->seq;
+        if (*pos == seq)
+            return -EAGAIN;
+
+        // We fell more than a whole ring behind: skip to the oldest sample kept
+        cursor = *pos;
+        if (seq - cursor > LUNIX_MSR_RING_LEN)
+            cursor = seq - LUNIX_MSR_RING_LEN;
+
+        // Only the most recent sample is wanted, skip the backlog
+        if (state->latest_only)
+            cursor = seq - 1;
+
+        // No need to copy over everything, just the next sample
+        memcpy(sample, lunix_msr_sample(msr, cursor),
+               LUNIX_MSR_SAMPLE_WORDS * sizeof(*sample));
+
+        // Caught up with the sensor: the text is already there
+        text_len = 0;
+        if (text && cursor + 1 == seq) {
+            text_len = min_t(uint32_t, msr->text_len, LUNIX_MSR_TEXT_LEN);
+            memcpy(text, msr->text, text_len);
+        }
+    } while (lunix_msr_read_retry(msr, start));
+
+    if (cursor != *pos && !state->latest_only)
+        debug("lost %u samples\n", cursor - *pos);
+    *pos = cursor + 1;
+
+    return text_len;
+}
+
+/*
+ * Whether the read policy of the open file lets it have a new sample yet
+ */
+static int lunix_chrdev_rate_ready(struct lunix_chrdev_state_struct *state)
+{
+    return !time_before(jiffies, state->next_read);
+}
+
+/*
+ * Sleeps until the read policy lets the open file have a new sample.
+ * Must be called with the character device state lock held; returns
+ * with it held, except on -ERESTARTSYS.
+ */
+static int lunix_chrdev_rate_wait(struct lunix_chrdev_state_struct *state,
+                                  bool nowait)
+{
+    long t;
+
+    // Read jiffies once, it may pass next_read between the check and the sleep
+    while ((t = (long)(state->next_read - jiffies)) > 0) {
+        if (nowait)
+            return -EAGAIN;
+        // Nothing can make the wait shorter, no need for the waitqueue
+        mutex_unlock(&state->lock);
+        schedule_timeout_interruptible(t);
+        if (signal_pending(current))
+            return -ERESTARTSYS;
+        if (mutex_lock_interruptible(&state->lock))
+            return -ERESTARTSYS;
+    }
+    return 0;
+}
+
+/*
+ * Starts the interval to wait before the next sample,
+ * after one has been handed to the reader
+ */
+static void lunix_chrdev_rate_mark(struct lunix_chrdev_state_struct *state)
+{
+    if (state->rate_interval)
+        state->next_read = jiffies + state->rate_interval;
+}
+
+/*
+ * The read policy held back a sample a poller was told about:
+ * wake up the pollers of the sensor, so that they look again
+ */
+static void lunix_chrdev_rate_expired(struct timer_list *t)
+{
+    struct lunix_chrdev_state_struct *state =
+        container_of(t, struct lunix_chrdev_state_struct, rate_timer);
+
+    wake_up_interruptible(&state->sensor->wq);
+}
+
 /*
  * Updates the cached state of a character device
  * based on sensor data. Must be called with the
@@ -68,59 +186,414 @@ static int lunix_chrdev_state_needs_refresh(struct lunix_chrdev_state_struct *st
  */
 static int lunix_chrdev_state_update(struct lunix_chrdev_state_struct *state)
 {
-    struct lunix_sensor_struct *sensor = state->sensor;	
+    uint32_t sample[LUNIX_MSR_SAMPLE_WORDS];
+    int text_len;
     // debug("leaving\n");
 
 	/*
-	 * Grab the raw data quickly, hold the
-	 * spinlock for as little as possible.
+	 * Grab the raw data quickly, without
+	 * ever blocking the line discipline.
 	 */
 	/* ? */
-	/* Why use spinlocks? See LDD3, p. 119 */
- 
-    /* MY CODE */ 
-    // Acquire sensor lock
-    spin_lock(&sensor->lock);
-
-    // Copy over: No need to copy over everything, just the new data
-    uint32_t last_update = sensor->msr_data[state->type]->last_update;
-    uint32_t raw_value = sensor->msr_data[state->type]->values[0];
-    // Release sensor lock
-    spin_unlock(&sensor->lock);
 
-    if (state->buf_timestamp == last_update)
+    /* MY CODE */ 
+    text_len = lunix_chrdev_state_fetch(state, &state->cursor, sample, state->buf_data);
+    if (text_len == -EAGAIN)
         return -EAGAIN;
-
     /* END OF MY CODE */
+
 	/*
 	 * Now we can take our time to format them,
-	 * holding only the private state semaphore
+	 * holding only the private state lock
 	 */
 	/* ? */
 
     /* MY CODE */
-    long lookup_value;
-    switch(state->type) {
-    case BATT:
-        lookup_value = lookup_voltage[raw_value];
-        break;
-    case TEMP: 
-        lookup_value = lookup_temperature[raw_value];
-        break;
-    case LIGHT:
-        lookup_value = lookup_light[raw_value];
-        break;
-    default:
-        return -EINVAL;
-    } 
-    state->buf_lim = sprintf(state->buf_data, "%ld.%03ld  ", lookup_value / 1000, lookup_value % 1000); 
-    state->buf_timestamp = last_update;
+    // Only readers lagging behind the sensor need to render the value
+    if (text_len == 0)
+        text_len = lunix_msr_format(state->buf_data, LUNIX_CHRDEV_BUFSZ,
+                                    (int32_t)sample[LUNIX_MSR_SAMPLE_CONV]);
+    state->buf_lim = text_len;
+    state->buf_timestamp = sample[LUNIX_MSR_SAMPLE_TS];
     /* END OF MY CODE */
 
     // debug("leaving\n");
 	return 0;
 }
 
+/*
+ * Fills the user buffer with as many binary records as fit,
+ * draining the sensor ring. The cursor only moves past the
+ * records that reached the reader: the rest are read again next
+ * time. Returns -EFAULT only if not even one record could be
+ * copied. Must be called with the character device state lock held.
+ */
+static ssize_t lunix_chrdev_state_read_records(struct lunix_chrdev_state_struct *state,
+                                               struct iov_iter *to)
+{
+    struct lunix_record batch[LUNIX_CHRDEV_BATCH];
+    uint32_t next[LUNIX_CHRDEV_BATCH];
+    uint32_t sample[LUNIX_MSR_SAMPLE_WORDS];
+    uint32_t pos = state->cursor;
+    size_t want = iov_iter_count(to) / sizeof(batch[0]);
+    size_t n, copied, done = 0;
+
+    while (done < want) {
+        // Gather a batch of records, then copy it out in one go
+        for (n = 0; n < LUNIX_CHRDEV_BATCH && done + n < want; n++) {
+            if (lunix_chrdev_state_fetch(state, &pos, sample, NULL) == -EAGAIN)
+                break;
+            next[n] = pos;
+            batch[n].sensor = state->sensor_id;
+            batch[n].type = state->type;
+            batch[n].timestamp = sample[LUNIX_MSR_SAMPLE_TS];
+            batch[n].raw = sample[LUNIX_MSR_SAMPLE_VALUE];
+            batch[n].value = sample[LUNIX_MSR_SAMPLE_CONV];
+            batch[n].timestamp_ns = lunix_msr_sample_ns(sample);
+        }
+        if (n == 0)
+            break;
+
+        // Whole records only: the bytes of a record copied in part are not counted
+        copied = copy_to_iter(batch, n * sizeof(batch[0]), to) / sizeof(batch[0]);
+        if (copied)
+            state->cursor = next[copied - 1];
+        done += copied;
+        if (copied < n)
+            return done ? done * sizeof(batch[0]) : -EFAULT;
+        if (n < LUNIX_CHRDEV_BATCH)
+            break;
+    }
+
+    return done ? done * sizeof(batch[0]) : -EAGAIN;
+}
+
+/*
+ * Takes a consistent snapshot of the latest measurements of a sensor.
+ * The line discipline opens the seqcount write sections of all pages
+ * of a sensor before updating any, so checking all three seqcounts
+ * guarantees the values come from a single packet.
+ */
+static void lunix_chrdev_snapshot_sensor(struct lunix_sensor_struct *sensor,
+                                         struct lunix_snapshot *snap)
+{
+    struct lunix_msr_data_struct *msr;
+    uint32_t start[N_LUNIX_MSR];
+    int i, retry;
+
+    do {
+        for (i = 0; i < N_LUNIX_MSR; i++)
+            start[i] = lunix_msr_read_begin(sensor->msr_data[i]);
+
+        for (i = 0; i < N_LUNIX_MSR; i++) {
+            msr = sensor->msr_data[i];
+            snap->last_update = msr->last_update;
+            snap->last_update_ns = msr->last_update_ns;
+            snap->raw[i] = msr->seq ? lunix_msr_sample(msr, msr->seq - 1)[LUNIX_MSR_SAMPLE_VALUE] : 0;
+            snap->value[i] = msr->value;
+        }
+
+        retry = 0;
+        for (i = 0; i < N_LUNIX_MSR; i++)
+            retry |= lunix_msr_read_retry(sensor->msr_data[i], start[i]);
+    } while (retry);
+
+    snap->sensor = sensor->id;
+}
+
+/*
+ * LUNIX_IOC_SNAPSHOT, for both kinds of device node.
+ * self is the sensor of the node, NULL for the "all sensors" node.
+ */
+static long lunix_chrdev_snapshot(struct lunix_sensor_struct *self, unsigned long arg)
+{
+    struct lunix_snapshot_req req;
+    struct lunix_snapshot snap;
+    struct lunix_snapshot __user *buf;
+    uint32_t i;
+
+    if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+        return -EFAULT;
+    buf = u64_to_user_ptr(req.buf);
+
+    if (req.count == 0) {
+        if (!self)
+            return -EINVAL;
+        lunix_chrdev_snapshot_sensor(self, &snap);
+        return copy_to_user(buf, &snap, sizeof(snap)) ? -EFAULT : 0;
+    }
+
+    if (req.count > LUNIX_SNAPSHOT_MAX || req.first >= lunix_sensor_cnt ||
+        req.count > lunix_sensor_cnt - req.first)
+        return -EINVAL;
+
+    for (i = 0; i < req.count; i++) {
+        lunix_chrdev_snapshot_sensor(lunix_sensors[req.first + i], &snap);
+        if (copy_to_user(&buf[i], &snap, sizeof(snap)))
+            return -EFAULT;
+    }
+    return 0;
+}
+
+/*************************************
+ * The "all sensors" node: a merged
+ * stream of binary records for every
+ * measurement of every sensor
+ *************************************/
+
+/*
+ * Called by the line discipline for every packet received.
+ * Queues one record per measurement to every open instance
+ * of the "all sensors" node, in order of arrival. Readers are
+ * woken up by lunix_chrdev_all_wake(), once per batch of packets.
+ */
+void lunix_chrdev_all_publish(unsigned int sensor_id, uint32_t timestamp,
+                              uint64_t timestamp_ns, const uint16_t *raw,
+                              const int32_t *value)
+{
+    struct lunix_chrdev_all_state_struct *state;
+    struct lunix_record rec[N_LUNIX_MSR];
+    int i;
+
+    // Nobody is listening, don't bother building the records
+    if (list_empty(&lunix_chrdev_all_list))
+        return;
+
+    for (i = 0; i < N_LUNIX_MSR; i++) {
+        rec[i].sensor = sensor_id;
+        rec[i].type = i;
+        rec[i].timestamp = timestamp;
+        rec[i].timestamp_ns = timestamp_ns;
+        rec[i].raw = raw[i];
+        rec[i].value = value[i];
+    }
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(state, &lunix_chrdev_all_list, list) {
+        // Queue all measurements of the packet or none of them
+        spin_lock(&state->lock);
+        if (kfifo_avail(&state->fifo) >= N_LUNIX_MSR)
+            kfifo_in(&state->fifo, rec, N_LUNIX_MSR);
+        else
+            state->dropped++;
+        spin_unlock(&state->lock);
+    }
+    rcu_read_unlock();
+}
+
+/*
+ * Wakes up the readers of the "all sensors" node
+ * which have records waiting
+ */
+void lunix_chrdev_all_wake(void)
+{
+    struct lunix_chrdev_all_state_struct *state;
+
+    if (list_empty(&lunix_chrdev_all_list))
+        return;
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(state, &lunix_chrdev_all_list, list) {
+        if (!kfifo_is_empty(&state->fifo))
+            wake_up_interruptible_poll(&state->wq, EPOLLIN | EPOLLRDNORM);
+    }
+    rcu_read_unlock();
+}
+
+static const struct file_operations lunix_chrdev_all_fops;
+
+static int lunix_chrdev_all_open(struct inode *inode, struct file *filp)
+{
+    struct lunix_chrdev_all_state_struct *state;
+    int ret;
+
+    state = kzalloc(sizeof(*state), GFP_KERNEL);
+    if (!state)
+        return -ENOMEM;
+
+    ret = kfifo_alloc(&state->fifo, LUNIX_CHRDEV_ALL_FIFO, GFP_KERNEL);
+    if (ret) {
+        kfree(state);
+        return ret;
+    }
+    spin_lock_init(&state->lock);
+    init_waitqueue_head(&state->wq);
+    mutex_init(&state->read_lock);
+    // Reads honour IOCB_NOWAIT, io_uring need not punt them to a worker
+    filp->f_mode |= FMODE_NOWAIT;
+
+    filp->private_data = state;
+    replace_fops(filp, fops_get(&lunix_chrdev_all_fops));
+
+    spin_lock(&lunix_chrdev_all_lock);
+    list_add_tail_rcu(&state->list, &lunix_chrdev_all_list);
+    spin_unlock(&lunix_chrdev_all_lock);
+
+    return 0;
+}
+
+static int lunix_chrdev_all_release(struct inode *inode, struct file *filp)
+{
+    struct lunix_chrdev_all_state_struct *state = filp->private_data;
+
+    spin_lock(&lunix_chrdev_all_lock);
+    list_del_rcu(&state->list);
+    spin_unlock(&lunix_chrdev_all_lock);
+
+    // Wait for the line discipline to let go of us
+    synchronize_rcu();
+
+    if (state->dropped)
+        debug("dropped %llu packets\n", state->dropped);
+    kfifo_free(&state->fifo);
+    mutex_destroy(&state->read_lock);
+    kfree(state);
+    return 0;
+}
+
+static ssize_t lunix_chrdev_all_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct lunix_chrdev_all_state_struct *state = iocb->ki_filp->private_data;
+    bool nowait = (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+    struct lunix_record batch[LUNIX_CHRDEV_BATCH];
+    size_t want = iov_iter_count(to) / sizeof(batch[0]);
+    size_t n, copied, done = 0;
+    ssize_t ret;
+
+    // Whole records only
+    if (want == 0)
+        return -EINVAL;
+
+    if (nowait) {
+        if (!mutex_trylock(&state->read_lock))
+            return -EAGAIN;
+    } else if (mutex_lock_interruptible(&state->read_lock))
+        return -ERESTARTSYS;
+
+    while (kfifo_is_empty(&state->fifo)) {
+        if (nowait) {
+            ret = -EAGAIN;
+            goto out;
+        }
+        mutex_unlock(&state->read_lock);
+        if (wait_event_interruptible(state->wq, !kfifo_is_empty(&state->fifo)))
+            return -ERESTARTSYS;
+        if (mutex_lock_interruptible(&state->read_lock))
+            return -ERESTARTSYS;
+    }
+
+    /*
+     * We are the only consumer, the producer side is locked separately.
+     * Records leave the fifo only once they have been copied out whole.
+     */
+    while (done < want) {
+        n = kfifo_out_peek(&state->fifo, batch, min_t(size_t, want - done, LUNIX_CHRDEV_BATCH));
+        if (n == 0)
+            break;
+        copied = copy_to_iter(batch, n * sizeof(batch[0]), to) / sizeof(batch[0]);
+        kfifo_out(&state->fifo, batch, copied);
+        done += copied;
+        if (copied < n) {
+            if (done == 0) {
+                ret = -EFAULT;
+                goto out;
+            }
+            break;
+        }
+    }
+    ret = done * sizeof(batch[0]);
+
+out:
+    mutex_unlock(&state->read_lock);
+    return ret;
+}
+
+static __poll_t lunix_chrdev_all_poll(struct file *filp, poll_table *wait)
+{
+    struct lunix_chrdev_all_state_struct *state = filp->private_data;
+
+    poll_wait(filp, &state->wq, wait);
+
+    return kfifo_is_empty(&state->fifo) ? 0 : EPOLLIN | EPOLLRDNORM;
+}
+
+static int lunix_chrdev_all_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    /*
+     * Map any contiguous range of the sensor table,
+     * page (sensor * N_LUNIX_MSR + type) being msr_data[type] of that sensor
+     */
+    unsigned long npages = vma_pages(vma);
+    unsigned long total = (unsigned long)lunix_sensor_cnt * N_LUNIX_MSR;
+    struct lunix_msr_data_struct *data;
+    unsigned long i, page;
+    int ret;
+
+    if (vma->vm_pgoff >= total || npages > total - vma->vm_pgoff) {
+        debug("mmap: pages [%lu, %lu) beyond the %lu sensor pages\n",
+              vma->vm_pgoff, vma->vm_pgoff + npages, total);
+        return -EINVAL;
+    }
+    // Remapping page by page only works for shared mappings
+    if (!(vma->vm_flags & VM_SHARED)) {
+        debug("mmap: the sensor table can only be mapped shared\n");
+        return -EINVAL;
+    }
+    // Readers in the kernel spin on the seqcounts, userspace may only look at them
+    if (vma->vm_flags & VM_WRITE) {
+        debug("mmap: the sensor table can only be mapped read-only\n");
+        return -EPERM;
+    }
+    vm_flags_clear(vma, VM_MAYWRITE);
+
+    for (i = 0; i < npages; i++) {
+        page = vma->vm_pgoff + i;
+        data = lunix_sensors[page / N_LUNIX_MSR]->msr_data[page % N_LUNIX_MSR];
+        ret = remap_pfn_range(vma, vma->vm_start + i * PAGE_SIZE,
+                              virt_to_phys(data) >> PAGE_SHIFT, PAGE_SIZE,
+                              vma->vm_page_prot);
+        if (ret) {
+            debug("lunix_chrdev_all_mmap - remap_pfn_range failed with %d\n", ret);
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static long lunix_chrdev_all_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct lunix_chrdev_all_state_struct *state = filp->private_data;
+    uint64_t dropped;
+
+    switch(cmd) {
+    case LUNIX_IOC_SNAPSHOT:
+        return lunix_chrdev_snapshot(NULL, arg);
+
+    case LUNIX_IOC_GET_DROPPED:
+        // Counted by the producers, under their lock
+        spin_lock(&state->lock);
+        dropped = state->dropped;
+        spin_unlock(&state->lock);
+
+        if (put_user(dropped, (uint64_t __user *)arg))
+            return -EFAULT;
+        return 0;
+
+    default:
+        return -EINVAL;
+    }
+}
+
+static const struct file_operations lunix_chrdev_all_fops =
+{
+	.owner          = THIS_MODULE,
+	.release        = lunix_chrdev_all_release,
+	.read_iter      = lunix_chrdev_all_read_iter,
+	.unlocked_ioctl = lunix_chrdev_all_ioctl,
+	.poll           = lunix_chrdev_all_poll,
+	.mmap           = lunix_chrdev_all_mmap
+};
+
 /*************************************
  * Implementation of file operations
  * for the Lunix character device
@@ -141,6 +614,12 @@ static int lunix_chrdev_open(struct inode *inode, struct file *filp)
 	ret = -ENODEV;
 	if ((ret = nonseekable_open(inode, filp)) < 0)
 		goto out;
+
+    /* The "all sensors" node has a state of its own */
+    if (iminor(inode) == LUNIX_CHRDEV_ALL_MINOR) {
+        ret = lunix_chrdev_all_open(inode, filp);
+        goto out;
+    }
 	
 	/* Allocate a new Lunix character device private state structure */
 	/* ? */
@@ -166,10 +645,21 @@ static int lunix_chrdev_open(struct inode *inode, struct file *filp)
     }
 
     state->type = msr_type;
-    state->sensor = &lunix_sensors[sensor_id];
+    state->sensor_id = sensor_id;
+    state->sensor = lunix_sensors[sensor_id];
+
+    // Start from the most recent sample, if there is one
+    state->cursor = READ_ONCE(state->sensor->msr_data[msr_type]->seq);
+    if (state->cursor)
+        state->cursor--;
 
     // buf_lim, buf_timestamp and eof_flag already initialized to 0
-    sema_init(&state->lock, 1);
+    // No read policy: every sample, as soon as it arrives
+    state->next_read = jiffies;
+    timer_setup(&state->rate_timer, lunix_chrdev_rate_expired, 0);
+    mutex_init(&state->lock);
+    // Reads honour IOCB_NOWAIT, io_uring need not punt them to a worker
+    filp->f_mode |= FMODE_NOWAIT;
     /* END OF MY CODE */
 
 out:
@@ -181,7 +671,11 @@ static int lunix_chrdev_release(struct inode *inode, struct file *filp)
 {
 	/* ? */
     /* MY CODE */
-    kfree(filp->private_data);
+    struct lunix_chrdev_state_struct *state = filp->private_data;
+
+    timer_delete_sync(&state->rate_timer);
+    mutex_destroy(&state->lock);
+    kfree(state);
     /* END OF MY CODE */
 	return 0;
 }
@@ -189,6 +683,10 @@ static int lunix_chrdev_release(struct inode *inode, struct file *filp)
 static long lunix_chrdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
     unsigned char val;
+    int mode;
+    struct lunix_rate rate;
+    struct lunix_aggr aggr;
+    uint32_t window_ms;
     struct lunix_chrdev_state_struct *state = filp->private_data;
     
     switch(cmd) {
@@ -198,32 +696,119 @@ static long lunix_chrdev_ioctl(struct file *filp, unsigned int cmd, unsigned lon
         if (val != 0 && val != 1)
             return -EINVAL;
 
-        if (down_interruptible(&state->lock))
+        if (mutex_lock_interruptible(&state->lock))
             return -ERESTARTSYS;
         state->auto_rewind_flag = val;
-        up(&state->lock);
+        mutex_unlock(&state->lock);
 
         return 0;
     
     case LUNIX_IOC_GET_REWIND: 
-        if (down_interruptible(&state->lock))
+        if (mutex_lock_interruptible(&state->lock))
             return -ERESTARTSYS;
         val = state->auto_rewind_flag;
-        up(&state->lock);
+        mutex_unlock(&state->lock);
         
         if (put_user(val, (unsigned char __user *)arg))
             return -EFAULT;
         return 0;
+
+    case LUNIX_IOC_SET_MODE:
+        if (get_user(mode, (int __user *)arg))
+            return -EFAULT;
+        if (mode != LUNIX_MODE_TEXT && mode != LUNIX_MODE_BINARY)
+            return -EINVAL;
+
+        if (mutex_lock_interruptible(&state->lock))
+            return -ERESTARTSYS;
+        // Drop any half-read text, the next read starts afresh
+        state->mode = mode;
+        state->buf_lim = 0;
+        filp->f_pos = 0;
+        mutex_unlock(&state->lock);
+
+        return 0;
+
+    case LUNIX_IOC_GET_MODE:
+        if (mutex_lock_interruptible(&state->lock))
+            return -ERESTARTSYS;
+        mode = state->mode;
+        mutex_unlock(&state->lock);
+
+        if (put_user(mode, (int __user *)arg))
+            return -EFAULT;
+        return 0;
+
+    case LUNIX_IOC_SNAPSHOT:
+        // Touches no private state, no need to lock
+        return lunix_chrdev_snapshot(state->sensor, arg);
+
+    case LUNIX_IOC_SET_RATE:
+        if (copy_from_user(&rate, (void __user *)arg, sizeof(rate)))
+            return -EFAULT;
+        if (rate.interval_ms > LUNIX_RATE_MAX_MS || rate.latest_only > 1)
+            return -EINVAL;
+
+        if (mutex_lock_interruptible(&state->lock))
+            return -ERESTARTSYS;
+        // The new interval applies from the next sample on
+        state->rate_interval = msecs_to_jiffies(rate.interval_ms);
+        state->latest_only = rate.latest_only;
+        state->next_read = jiffies;
+        mutex_unlock(&state->lock);
+
+        return 0;
+
+    case LUNIX_IOC_GET_RATE:
+        if (mutex_lock_interruptible(&state->lock))
+            return -ERESTARTSYS;
+        rate.interval_ms = jiffies_to_msecs(state->rate_interval);
+        rate.latest_only = state->latest_only;
+        mutex_unlock(&state->lock);
+
+        if (copy_to_user((void __user *)arg, &rate, sizeof(rate)))
+            return -EFAULT;
+        return 0;
+
+    case LUNIX_IOC_GET_AGGR:
+        // The aggregates belong to the sensor, which locks them itself
+        lunix_sensor_aggr_get(state->sensor, state->type, &aggr);
+        if (copy_to_user((void __user *)arg, &aggr, sizeof(aggr)))
+            return -EFAULT;
+        return 0;
+
+    case LUNIX_IOC_SET_WINDOW:
+        if (get_user(window_ms, (uint32_t __user *)arg))
+            return -EFAULT;
+        if (window_ms == 0 || window_ms > LUNIX_WINDOW_MAX_MS)
+            return -EINVAL;
+        lunix_sensor_aggr_set(state->sensor, state->type, window_ms);
+        return 0;
     
     default:
         return -EINVAL;
     }
 }
 
-static ssize_t lunix_chrdev_read(struct file *filp, char __user *usrbuf, size_t cnt, loff_t *f_pos)
+/*
+ * Takes the state lock of an open file. Readers which must not
+ * block, either O_NONBLOCK or IOCB_NOWAIT, only try to.
+ */
+static int lunix_chrdev_state_lock(struct lunix_chrdev_state_struct *state, bool nowait)
+{
+    if (nowait)
+        return mutex_trylock(&state->lock) ? 0 : -EAGAIN;
+    return mutex_lock_interruptible(&state->lock) ? -ERESTARTSYS : 0;
+}
+
+static ssize_t lunix_chrdev_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
     ssize_t ret;
 
+    struct file *filp = iocb->ki_filp;
+    loff_t *f_pos = &iocb->ki_pos;
+    size_t cnt = iov_iter_count(to);
+    bool nowait = (filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
     struct lunix_sensor_struct *sensor;
     struct lunix_chrdev_state_struct *state;
 
@@ -234,8 +819,34 @@ static ssize_t lunix_chrdev_read(struct file *filp, char __user *usrbuf, size_t
     WARN_ON(!sensor);
 
     /* MY CODE - Lock */
-    if (down_interruptible(&state->lock))
-        return -ERESTARTSYS;
+    ret = lunix_chrdev_state_lock(state, nowait);
+    if (ret)
+        return ret;
+
+    /* Binary mode: whole records only, as many as fit */
+    if (state->mode == LUNIX_MODE_BINARY) {
+        if (cnt < sizeof(struct lunix_record)) {
+            ret = -EINVAL;
+            goto out;
+        }
+        ret = lunix_chrdev_rate_wait(state, nowait);
+        if (ret == -ERESTARTSYS)
+            return ret;
+        if (ret)
+            goto out;
+        while ((ret = lunix_chrdev_state_read_records(state, to)) == -EAGAIN) {
+            if (nowait)
+                goto out;
+            mutex_unlock(&state->lock);
+            if (wait_event_interruptible(sensor->wq, lunix_chrdev_state_needs_refresh(state)))
+                return -ERESTARTSYS;
+            if (mutex_lock_interruptible(&state->lock))
+                return -ERESTARTSYS;
+        }
+        if (ret > 0)
+            lunix_chrdev_rate_mark(state);
+        goto out;
+    }
     
     /* Auto-rewind on EOF mode? */
     if (state->auto_rewind_flag && *f_pos >= state->buf_lim)
@@ -245,8 +856,14 @@ static ssize_t lunix_chrdev_read(struct file *filp, char __user *usrbuf, size_t
      * If the cached character device state needs to be updated and we are at the start.
      */
     if (*f_pos == 0) {
-        // Non blocking mode
-        if (filp->f_flags & O_NONBLOCK) {
+        // Hold back the next sample until the read policy allows it
+        ret = lunix_chrdev_rate_wait(state, nowait);
+        if (ret == -ERESTARTSYS)
+            return ret;
+        if (ret)
+            goto out;
+        // Non blocking mode, including io_uring and AIO submissions
+        if (nowait) {
             if (lunix_chrdev_state_update(state) == -EAGAIN) {
                 ret = -EAGAIN;
                 goto out;
@@ -255,13 +872,14 @@ static ssize_t lunix_chrdev_read(struct file *filp, char __user *usrbuf, size_t
         // Blocking mode: Wait until new data has come
         else {
             while (lunix_chrdev_state_update(state) == -EAGAIN) {
-                up(&state->lock);        
+                mutex_unlock(&state->lock);        
                 if(wait_event_interruptible(sensor->wq, lunix_chrdev_state_needs_refresh(state)))
                     return -ERESTARTSYS;
-                if (down_interruptible(&state->lock))
+                if (mutex_lock_interruptible(&state->lock))
                     return -ERESTARTSYS;
             }
         }
+        lunix_chrdev_rate_mark(state);
     }
 
     /* * 1. End of file: If we reach the end of the buffered data, 
@@ -277,7 +895,7 @@ static ssize_t lunix_chrdev_read(struct file *filp, char __user *usrbuf, size_t
     /* 2. Determine the number of cached bytes to copy to userspace */
     ssize_t bytes_to_copy = min_t(ssize_t, cnt, state->buf_lim - *f_pos);
     
-    if (copy_to_user(usrbuf, state->buf_data + *f_pos, bytes_to_copy)) {
+    if (copy_to_iter(state->buf_data + *f_pos, bytes_to_copy, to) != bytes_to_copy) {
         ret = -EFAULT;
         goto out;
     }
@@ -294,7 +912,7 @@ static ssize_t lunix_chrdev_read(struct file *filp, char __user *usrbuf, size_t
     }
 
 out:
-    up(&state->lock);
+    mutex_unlock(&state->lock);
     return ret;
 }
 // static ssize_t lunix_chrdev_read(struct file *filp, char __user *usrbuf, size_t cnt, loff_t *f_pos)
@@ -378,6 +996,34 @@ out:
 // 	return ret;
 // }
 
+static __poll_t lunix_chrdev_poll(struct file *filp, poll_table *wait)
+{
+    struct lunix_chrdev_state_struct *state = filp->private_data;
+    __poll_t mask = 0;
+
+    WARN_ON(!state);
+
+    poll_wait(filp, &state->sensor->wq, wait);
+
+    /*
+     * Readable if a fresh sample has arrived and the read policy lets
+     * us have it, or if there is still some of the cached text left.
+     * A sample held back by the read policy arms the rate timer, which
+     * wakes us up once the interval has passed, even if the sensor
+     * has nothing new by then.
+     */
+    if (lunix_chrdev_state_needs_refresh(state)) {
+        if (lunix_chrdev_rate_ready(state))
+            mask |= EPOLLIN | EPOLLRDNORM;
+        else
+            mod_timer(&state->rate_timer, READ_ONCE(state->next_read));
+    }
+    if (state->mode == LUNIX_MODE_TEXT && filp->f_pos != 0 && filp->f_pos < state->buf_lim)
+        mask |= EPOLLIN | EPOLLRDNORM;
+
+    return mask;
+}
+
 static int lunix_chrdev_mmap(struct file *filp, struct vm_area_struct *vma)
 {
     /* 
@@ -399,6 +1045,12 @@ static int lunix_chrdev_mmap(struct file *filp, struct vm_area_struct *vma)
         debug("mmap: Vma should have 0 page offset\n");
         return -EINVAL;
     }
+    // Readers in the kernel spin on the seqcount, userspace may only look at it
+    if (vma->vm_flags & VM_WRITE) {
+        debug("mmap: measurement pages can only be mapped read-only\n");
+        return -EPERM;
+    }
+    vm_flags_clear(vma, VM_MAYWRITE);
 
     // Get data's physical address
     unsigned long data_pfn = virt_to_phys(data) >> PAGE_SHIFT;
@@ -417,8 +1069,9 @@ static struct file_operations lunix_chrdev_fops =
 	.owner          = THIS_MODULE,
 	.open           = lunix_chrdev_open,
 	.release        = lunix_chrdev_release,
-	.read           = lunix_chrdev_read,
+	.read_iter      = lunix_chrdev_read_iter,
 	.unlocked_ioctl = lunix_chrdev_ioctl,
+	.poll           = lunix_chrdev_poll,
 	.mmap           = lunix_chrdev_mmap
 };
 
@@ -426,12 +1079,12 @@ int lunix_chrdev_init(void)
 {
 	/*
 	 * Register the character device with the kernel, asking for
-	 * a range of minor numbers (number of sensors * 8 measurements / sensor)
-	 * beginning with LINUX_CHRDEV_MAJOR:0
+	 * a range of minor numbers (number of sensors * 8 measurements / sensor,
+	 * plus the "all sensors" node) beginning with LINUX_CHRDEV_MAJOR:0
 	 */
 	int ret;
 	dev_t dev_no;
-	unsigned int lunix_minor_cnt = lunix_sensor_cnt << 3;
+	unsigned int lunix_minor_cnt = LUNIX_CHRDEV_ALL_MINOR + 1;
 
 	debug("initializing character device\n");
 	cdev_init(&lunix_chrdev_cdev, &lunix_chrdev_fops);
@@ -490,7 +1143,7 @@ out:
 void lunix_chrdev_destroy(void)
 {
 	dev_t dev_no;
-	unsigned int lunix_minor_cnt = lunix_sensor_cnt << 3;
+	unsigned int lunix_minor_cnt = LUNIX_CHRDEV_ALL_MINOR + 1;
 
 	debug("entering\n");
 	dev_no = MKDEV(LUNIX_CHRDEV_MAJOR, 0);
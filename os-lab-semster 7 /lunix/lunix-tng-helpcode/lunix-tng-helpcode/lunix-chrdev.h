@@ -14,18 +14,121 @@
  * Lunix:TNG character device
  */
 #define LUNIX_CHRDEV_MAJOR 60   /* Reserved for local / experimental use */
-#define LUNIX_CHRDEV_BUFSZ 20   /* Buffer size used to hold textual info */
+#define LUNIX_CHRDEV_BUFSZ LUNIX_MSR_TEXT_LEN /* Buffer size used to hold textual info */
+#define LUNIX_CHRDEV_BATCH 16   /* Binary records gathered per copy_to_user() */
+#define LUNIX_CHRDEV_ALL_FIFO 2048 /* Records queued per open "all sensors" node */
 
 /* Compile-time parameters */
 
+#ifdef __KERNEL__ 
+#include <linux/types.h>
+#else
+#include <inttypes.h>
+#include "lunix.h"
+#endif /* __KERNEL__ */
+
+/*
+ * Read modes, selected with LUNIX_IOC_SET_MODE.
+ * In text mode read() returns the formatted value of one sample at a time.
+ * In binary mode it returns as many whole struct lunix_record as fit,
+ * which is also the only format of the "all sensors" node.
+ */
+#define LUNIX_MODE_TEXT     0
+#define LUNIX_MODE_BINARY   1
+
+struct lunix_record {
+	uint32_t sensor;        /* Sensor number, as in the minor */
+	uint32_t type;          /* enum lunix_msr_enum */
+	uint64_t timestamp;     /* Seconds since the epoch */
+	uint32_t raw;           /* Raw 16-bit measurement */
+	int32_t value;          /* Converted value, in milli-units */
+	uint64_t timestamp_ns;  /* CLOCK_MONOTONIC nanoseconds */
+} __attribute__((packed));
+
+/*
+ * LUNIX_IOC_SNAPSHOT copies the latest measurements of sensors
+ * [first, first + count) to buf, one struct lunix_snapshot each.
+ * The measurements of each sensor all come from the same packet.
+ * A count of 0 means the sensor of the device node itself.
+ */
+struct lunix_snapshot {
+	uint32_t sensor;
+	uint32_t last_update;   /* Seconds since the epoch, 0 if never updated */
+	uint32_t raw[N_LUNIX_MSR];
+	int32_t value[N_LUNIX_MSR];
+	uint64_t last_update_ns; /* CLOCK_MONOTONIC nanoseconds */
+};
+
+struct lunix_snapshot_req {
+	uint32_t first;
+	uint32_t count;
+	uint64_t buf;           /* struct lunix_snapshot *, as an integer */
+};
+
+#define LUNIX_SNAPSHOT_MAX 4096 /* Maximum count per call */
+
+/*
+ * LUNIX_IOC_SET_RATE limits how often read() returns a new sample:
+ * at most one every interval_ms milliseconds, 0 for no limit. With
+ * latest_only set, the samples that queued up in the ring meanwhile
+ * are skipped and read() always returns the most recent one.
+ */
+struct lunix_rate {
+	uint32_t interval_ms;
+	uint32_t latest_only;
+};
+
+#define LUNIX_RATE_MAX_MS 3600000 /* Longest interval, an hour */
+
+/*
+ * LUNIX_IOC_GET_AGGR returns the aggregates of the converted values of
+ * the measurement of the node, over tumbling windows of window_ms
+ * milliseconds: the window in progress and the last complete one.
+ * A window starts with its first sample; min, max and mean are 0 for
+ * a window with no samples. LUNIX_IOC_SET_WINDOW changes window_ms
+ * for the measurement, for every reader, and starts afresh.
+ */
+struct lunix_aggr_window {
+	uint64_t start_ns;      /* CLOCK_MONOTONIC nanoseconds */
+	uint32_t count;
+	int32_t min;            /* In milli-units */
+	int32_t max;
+	int32_t mean;
+};
+
+struct lunix_aggr {
+	uint32_t window_ms;
+	uint32_t reserved;
+	struct lunix_aggr_window cur;
+	struct lunix_aggr_window last;
+};
+
+#define LUNIX_WINDOW_MAX_MS 3600000 /* Longest window, an hour */
+
+/*
+ * LUNIX_IOC_GET_DROPPED, on the "all sensors" node, returns how many
+ * packets were lost since the node was opened because the records of
+ * the open file had filled up, as a uint64_t. Every measurement of a
+ * dropped packet is lost, never only some of them.
+ */
+
 #ifdef __KERNEL__ 
 
 #include <linux/fs.h>
+#include <linux/kfifo.h>
+#include <linux/mutex.h>
+#include <linux/timer.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
 
 #include "lunix.h"
 
+/*
+ * The "all sensors" node [/dev/lunix-all]
+ * follows the minors of the individual sensors
+ */
+#define LUNIX_CHRDEV_ALL_MINOR (lunix_sensor_cnt << 3)
+
 /*
  * Private state for an open character device node
  */
@@ -47,6 +150,7 @@
 
 struct lunix_chrdev_state_struct {
 	enum lunix_msr_enum type;
+	unsigned int sensor_id;
 	struct lunix_sensor_struct *sensor;
 
 	/* A buffer used to hold cached textual info */
@@ -54,21 +158,53 @@ struct lunix_chrdev_state_struct {
 	unsigned char buf_data[LUNIX_CHRDEV_BUFSZ];
 	uint32_t buf_timestamp;
 
-	struct semaphore lock;
+	/* Sequence number of the next sample to be read from the ring */
+	uint32_t cursor;
+
+	/* Serializes readers and ioctls sharing the open file */
+	struct mutex lock;
 
 	/* Add this line */
 	uint8_t auto_rewind_flag;
 
+	/* LUNIX_MODE_TEXT or LUNIX_MODE_BINARY */
+	int mode;
+
+	/* Read policy, set with LUNIX_IOC_SET_RATE */
+	unsigned long rate_interval;    /* Minimum jiffies between samples */
+	unsigned long next_read;        /* No new sample before this */
+	int latest_only;
+	struct timer_list rate_timer;   /* Wakes up pollers at next_read */
+
 	/*
 	 * Fixme: Any mode settings? e.g. blocking vs. non-blocking
 	 */
 };
 
+/*
+ * Private state for an open "all sensors" node
+ */
+struct lunix_chrdev_all_state_struct {
+	struct list_head list;
+
+	/* Records of every sensor, in order of arrival */
+	DECLARE_KFIFO_PTR(fifo, struct lunix_record);
+	spinlock_t lock;                /* Serializes producers */
+	uint64_t dropped;               /* Packets lost to a full fifo */
+
+	wait_queue_head_t wq;
+	struct mutex read_lock;         /* Serializes consumers */
+};
+
 /*
  * Function prototypes
  */
 int lunix_chrdev_init(void);
 void lunix_chrdev_destroy(void);
+void lunix_chrdev_all_publish(unsigned int sensor_id, uint32_t timestamp,
+                              uint64_t timestamp_ns, const uint16_t *raw,
+                              const int32_t *value);
+void lunix_chrdev_all_wake(void);
 
 #endif /* __KERNEL__ */
 
@@ -79,10 +215,18 @@ void lunix_chrdev_destroy(void);
  */
 #define LUNIX_IOC_SET_REWIND  _IOW(LUNIX_IOC_MAGIC, 1, int)
 #define LUNIX_IOC_GET_REWIND  _IOR(LUNIX_IOC_MAGIC, 2, int)
+#define LUNIX_IOC_SET_MODE    _IOW(LUNIX_IOC_MAGIC, 3, int)
+#define LUNIX_IOC_GET_MODE    _IOR(LUNIX_IOC_MAGIC, 4, int)
+#define LUNIX_IOC_SNAPSHOT    _IOW(LUNIX_IOC_MAGIC, 5, struct lunix_snapshot_req)
+#define LUNIX_IOC_SET_RATE    _IOW(LUNIX_IOC_MAGIC, 6, struct lunix_rate)
+#define LUNIX_IOC_GET_RATE    _IOR(LUNIX_IOC_MAGIC, 7, struct lunix_rate)
+#define LUNIX_IOC_GET_AGGR    _IOR(LUNIX_IOC_MAGIC, 8, struct lunix_aggr)
+#define LUNIX_IOC_SET_WINDOW  _IOW(LUNIX_IOC_MAGIC, 9, uint32_t)
+#define LUNIX_IOC_GET_DROPPED _IOR(LUNIX_IOC_MAGIC, 10, uint64_t)
 
 #define LUNIX_IOC_MAGIC     LUNIX_CHRDEV_MAJOR
 //#define LUNIX_IOC_EXAMPLE _IOR(LUNIX_IOC_MAGIC, 0, void *)
 
-#define LUNIX_IOC_MAXNR 0
+#define LUNIX_IOC_MAXNR 10
 
 #endif /* _LUNIX_H */
@@ -0,0 +1,297 @@
+/*
+ * lunix-gen.c
+ *
+ * Synthetic XMesh traffic generator for Lunix:TNG.
+ *
+ * Emits valid, escaped XMesh sensor packets for a number of
+ * synthetic nodes at a given rate, into a new pseudo-terminal
+ * (or any other file), so that the driver can be load tested
+ * without the wireless sensor network. Attach the Lunix line
+ * discipline to the slave side with lunix-attach.
+ *
+ */
+
+#define _XOPEN_SOURCE 600       /* posix_openpt() and friends */
+
+#include <time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lunix-protocol.h"
+
+/*
+ * The packets generated, following the PACKET STRUCTURE comment
+ * in lunix-protocol.c. The sensor readings lie at fixed offsets
+ * in the payload, as lunix-protocol.h expects them.
+ */
+#define GEN_PACKET_TYPE     0x42    /* Must be neither 0x7E nor 0x7D */
+#define GEN_AM_TYPE         0x0B    /* Sensor reading */
+#define GEN_AM_GROUP        0x7D
+#define GEN_PAYLOAD_LEN     29
+#define GEN_PACKET_LEN      (7 + GEN_PAYLOAD_LEN + 3)
+
+/* Packets are written out in batches of about this many bytes */
+#define GEN_BUF_LEN         4096
+
+static volatile sig_atomic_t gen_stop;
+static unsigned long gen_packets;
+
+/* Filled in by gen_crc_init(), the same as lunix_protocol_crc_table */
+static uint16_t gen_crc_table[256];
+
+/* Compute the CRC-16 of every byte value, one bit at a time */
+static void gen_crc_init(void)
+{
+	uint16_t crc;
+	int i, bit;
+
+	for (i = 0; i < 256; i++) {
+		crc = i << 8;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ LUNIX_PROTOCOL_CRC_POLY : crc << 1;
+		gen_crc_table[i] = crc;
+	}
+}
+
+/* CRC-16/CCITT of a packet, as checked by lunix-protocol.c */
+static uint16_t gen_crc(const unsigned char *p, int len)
+{
+	uint16_t crc = 0;
+
+	while (len--)
+		crc = (crc << 8) ^ gen_crc_table[(crc >> 8) ^ *p++];
+
+	return crc;
+}
+
+static void put_le16(unsigned char *p, uint16_t v)
+{
+	p[0] = v & 0xFF;
+	p[1] = v >> 8;
+}
+
+/* Append a byte to out, escaping it if it is a special character. */
+static int gen_escape(unsigned char *out, unsigned char c)
+{
+	if (c == 0x7E || c == 0x7D) {
+		out[0] = 0x7D;
+		out[1] = c ^ 0x20;
+		return 2;
+	}
+	out[0] = c;
+	return 1;
+}
+
+/*
+ * Build the escaped packet of a sensor reading into out,
+ * which must hold 2 * GEN_PACKET_LEN bytes. Returns its length.
+ */
+static int gen_packet(unsigned char *out, uint16_t nodeid,
+                      uint16_t batt, uint16_t temp, uint16_t light)
+{
+	unsigned char packet[GEN_PACKET_LEN];
+	uint16_t crc;
+	int i, n;
+
+	memset(packet, 0, sizeof(packet));
+	packet[0] = 0x7E;
+	packet[1] = GEN_PACKET_TYPE;
+	put_le16(&packet[2], 0xFFFF);           /* Broadcast */
+	packet[PACKET_SIGNATURE_OFFSET] = GEN_AM_TYPE;
+	packet[5] = GEN_AM_GROUP;
+	packet[6] = GEN_PAYLOAD_LEN;
+	put_le16(&packet[NODE_OFFSET], nodeid);
+	put_le16(&packet[VREF_OFFSET], batt);
+	put_le16(&packet[TEMPERATURE_OFFSET], temp);
+	put_le16(&packet[LIGHT_OFFSET], light);
+
+	/* The CRC covers everything between the start byte and itself */
+	crc = gen_crc(&packet[1], 6 + GEN_PAYLOAD_LEN);
+	put_le16(&packet[7 + GEN_PAYLOAD_LEN], crc);
+	packet[GEN_PACKET_LEN - 1] = 0x7E;
+
+	/* Neither the start byte, nor the packet type, nor the end byte are escaped */
+	n = 0;
+	out[n++] = packet[0];
+	out[n++] = packet[1];
+	for (i = 2; i < GEN_PACKET_LEN - 1; i++)
+		n += gen_escape(&out[n], packet[i]);
+	out[n++] = packet[GEN_PACKET_LEN - 1];
+
+	return n;
+}
+
+/* Write a whole buffer out, retrying on short writes. */
+static int gen_write(int fd, const unsigned char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR && !gen_stop)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* Open a new pseudo-terminal, and tell the user where its slave side is. */
+static int gen_open_pty(void)
+{
+	int fd;
+	char *name;
+
+	if ((fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0) {
+		perror("posix_openpt");
+		return -1;
+	}
+	if (grantpt(fd) < 0 || unlockpt(fd) < 0 || !(name = ptsname(fd))) {
+		perror("pty setup");
+		close(fd);
+		return -1;
+	}
+	fprintf(stderr, "Generating XMesh traffic on %s, attach to it with lunix-attach\n",
+	        name);
+
+	return fd;
+}
+
+static void gen_timespec_add(struct timespec *ts, long ns)
+{
+	ts->tv_nsec += ns;
+	while (ts->tv_nsec >= 1000000000L) {
+		ts->tv_nsec -= 1000000000L;
+		ts->tv_sec++;
+	}
+}
+
+/* Catch any signals. */
+static void sig_catch(int sig)
+{
+	gen_stop = 1;
+}
+
+int main(int argc, char *argv[])
+{
+	int fd, opt;
+	char *end;
+	char *path = NULL;
+	unsigned long nodes = 16, rate = 100, count = 0;
+	unsigned long node;
+	unsigned char buf[GEN_BUF_LEN + 2 * GEN_PACKET_LEN];
+	size_t len;
+	long period, batch, i;
+	struct timespec next, start, stop;
+	double secs;
+
+	while ((opt = getopt(argc, argv, "n:r:c:o:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nodes = strtoul(optarg, &end, 0);
+			if (*optarg == '\0' || *end != '\0' || nodes == 0 || nodes > 65535)
+				goto usage;
+			break;
+		case 'r':
+			rate = strtoul(optarg, &end, 0);
+			if (*optarg == '\0' || *end != '\0' || rate == 0 || rate > 1000000000UL)
+				goto usage;
+			break;
+		case 'c':
+			count = strtoul(optarg, &end, 0);
+			if (*optarg == '\0' || *end != '\0')
+				goto usage;
+			break;
+		case 'o':
+			path = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc)
+		goto usage;
+
+	gen_crc_init();
+	if (path) {
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOCTTY, 0644)) < 0) {
+			perror(path);
+			return 1;
+		}
+	} else if ((fd = gen_open_pty()) < 0)
+		return 1;
+
+	(void) signal(SIGHUP, sig_catch);
+	(void) signal(SIGINT, sig_catch);
+	(void) signal(SIGQUIT, sig_catch);
+	(void) signal(SIGTERM, sig_catch);
+
+	/*
+	 * Packets go out in bursts, every 1ms at most,
+	 * each one due at the start of its own period
+	 */
+	period = 1000000000L / rate;
+	batch = 1000000L / (period ? period : 1);
+	if (batch < 1)
+		batch = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	next = start;
+	node = 0;
+	while (!gen_stop && (count == 0 || gen_packets < count)) {
+		len = 0;
+		for (i = 0; i < batch && (count == 0 || gen_packets < count); i++) {
+			/* Readings wander around, so that every packet is a fresh one */
+			len += gen_packet(&buf[len], node + 1,
+			                  (gen_packets * 7 + node) & 0x3FF,
+			                  (gen_packets * 3 + node * 13) & 0x3FF,
+			                  (gen_packets * 257 + node) & 0xFFFF);
+			node = (node + 1) % nodes;
+			gen_packets++;
+			if (len >= GEN_BUF_LEN) {
+				if (gen_write(fd, buf, len) < 0)
+					goto out_write;
+				len = 0;
+			}
+		}
+		if (len && gen_write(fd, buf, len) < 0)
+			goto out_write;
+
+		gen_timespec_add(&next, period * batch);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+			if (gen_stop)
+				break;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	secs = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "%lu packets in %.3f s, %.1f packets/s\n",
+	        gen_packets, secs, secs > 0 ? gen_packets / secs : 0.0);
+	close(fd);
+	return 0;
+
+out_write:
+	perror("write");
+	close(fd);
+	return 1;
+
+usage:
+	fprintf(stderr,
+	        "Usage: %s [-n nodes] [-r rate] [-c count] [-o output]\n"
+	        "Generate XMesh packets for nodes 1..nodes [default: 16], in turn,\n"
+	        "at rate packets per second [default: 100], until count packets\n"
+	        "have been sent [default: forever] or a signal arrives.\n"
+	        "Packets go to a new pseudo-terminal, or to output if given.\n\n",
+	        argv[0]);
+	exit(1);
+}
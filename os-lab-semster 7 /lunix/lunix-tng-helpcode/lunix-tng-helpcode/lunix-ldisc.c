@@ -22,8 +22,9 @@
 #include "lunix-protocol.h"
 
 /*
- * This line discipline can only be associated
- * with a single TTY at any time.
+ * This line discipline can be associated
+ * with up to lunix_ldisc_max TTYs at any time,
+ * each one with a protocol state machine of its own.
  */
 static atomic_t lunix_disc_available;
 
@@ -33,13 +34,24 @@ static atomic_t lunix_disc_available;
  */
 static int lunix_ldisc_open(struct tty_struct *tty)
 {
+	struct lunix_protocol_state_struct *state;
+
 	if (!capable(CAP_SYS_ADMIN))
 		return -EPERM;
 
-	/* Can only be associated with a single TTY */
+	/* Can only be associated with lunix_ldisc_max TTYs */
 	if ( !atomic_add_unless(&lunix_disc_available, -1, 0))
 		return -EBUSY;
 
+	state = kzalloc(sizeof(*state), GFP_KERNEL);
+	if (!state || lunix_protocol_create(state) < 0) {
+		kfree(state);
+		atomic_inc(&lunix_disc_available);
+		return -ENOMEM;
+	}
+	lunix_protocol_debugfs_init(state, tty->name);
+	tty->disc_data = state;
+
 	tty->receive_room = 65536; /* No flow control, FIXME */
 
 	debug("lunix ldisc associated with TTY %s\n", tty->name);
@@ -52,12 +64,47 @@ static int lunix_ldisc_open(struct tty_struct *tty)
  */
 static void lunix_ldisc_close(struct tty_struct *tty)
 {
+	struct lunix_protocol_state_struct *state = tty->disc_data;
+
+	tty->disc_data = NULL;
+	lunix_protocol_debugfs_destroy(state);
+	lunix_protocol_destroy(state);
+	kfree(state);
+
 	atomic_inc(&lunix_disc_available);
 	/* FIXME */
 	/* Shouldn't we wake up all sleepers in all sensors here? */
 	debug("lunix ldisc being closed\n");
 }
 
+/*
+ * Per-TTY settings. Anything else is a
+ * termios ioctl, handled by the TTY layer.
+ */
+static int lunix_ldisc_ioctl(struct tty_struct *tty, unsigned int cmd,
+                             unsigned long arg)
+{
+	struct lunix_protocol_state_struct *state = tty->disc_data;
+	unsigned int base;
+
+	switch (cmd) {
+	case LUNIX_LDISC_IOC_SET_BASE:
+		if (get_user(base, (unsigned int __user *)arg))
+			return -EFAULT;
+		if (base >= lunix_sensor_cnt)
+			return -EINVAL;
+		WRITE_ONCE(state->sensor_base, base);
+		return 0;
+
+	case LUNIX_LDISC_IOC_GET_BASE:
+		base = READ_ONCE(state->sensor_base);
+		return put_user(base, (unsigned int __user *)arg);
+
+	default:
+		return tty_mode_ioctl(tty, cmd, arg);
+	}
+}
+
 /*
  * lunix_ldisc_receive_buf() is called by the TTY layer when data have been
  * received by the low level TTY driver and are ready for us. This function
@@ -77,10 +124,10 @@ static void lunix_ldisc_receive_buf(struct tty_struct *tty,
 #endif
 
 	/*
-	 * Pass incoming characters to protocol processing code,
-	 * which handles any necessary sensor updates.
+	 * Pass incoming characters to the protocol processing code
+	 * of this TTY, which handles any necessary sensor updates.
 	 */
-	lunix_protocol_received_buf(&lunix_protocol_state, cp, count);
+	lunix_protocol_received_buf(tty->disc_data, cp, count);
 }
 
 /*
@@ -114,6 +161,7 @@ static struct tty_ldisc_ops lunix_ldisc_ops = {
 	.close       = lunix_ldisc_close,
 	.read        = lunix_ldisc_read,
 	.write       = lunix_ldisc_write,
+	.ioctl       = lunix_ldisc_ioctl,
 	.receive_buf = lunix_ldisc_receive_buf
 };
 
@@ -122,7 +170,11 @@ int lunix_ldisc_init(void)
 	int ret;
 
 	debug("initializing lunix ldisc\n");
-	atomic_set(&lunix_disc_available, 1);
+	if (lunix_ldisc_max <= 0) {
+		printk(KERN_ERR "%s: lunix_ldisc_max must be positive\n", __FILE__);
+		return -EINVAL;
+	}
+	atomic_set(&lunix_disc_available, lunix_ldisc_max);
 	ret = tty_register_ldisc(&lunix_ldisc_ops);
 	if (ret)
 		printk(KERN_ERR "%s: Error registering line discipline, ret = %d.\n",
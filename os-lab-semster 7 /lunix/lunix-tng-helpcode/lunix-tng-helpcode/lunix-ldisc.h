@@ -1,5 +1,5 @@
 /*
- * lunix-chrdev.h
+ * lunix-ldisc.h
  *
  * Definition file for the
  * Lunix:TNG TTY line discipline
@@ -12,9 +12,12 @@
 #define _LUNIX_LDISC_H
 
 /* Compile-time parameters */
+#define LUNIX_LDISC_MAX 8       /* Default maximum number of attached TTYs */
 
 #ifdef __KERNEL__ 
 
+extern int lunix_ldisc_max;
+
 /*
  * Function prototypes
  */
@@ -23,5 +26,16 @@ void lunix_ldisc_destroy(void);
 
 #endif /* __KERNEL__ */
 
+#include <linux/ioctl.h>
+
+/*
+ * ioctl commands on a TTY carrying the Lunix line discipline.
+ * Node id N received on the TTY updates sensor (base + N - 1),
+ * so that several base stations can share the sensor table.
+ */
+#define LUNIX_LDISC_IOC_MAGIC     'L'
+#define LUNIX_LDISC_IOC_SET_BASE  _IOW(LUNIX_LDISC_IOC_MAGIC, 1, unsigned int)
+#define LUNIX_LDISC_IOC_GET_BASE  _IOR(LUNIX_LDISC_IOC_MAGIC, 2, unsigned int)
+
 #endif /* _LUNIX_H */
 
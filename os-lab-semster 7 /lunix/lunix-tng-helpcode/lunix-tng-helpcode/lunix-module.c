@@ -10,6 +10,9 @@
 #include <linux/slab.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/numa.h>
+#include <linux/nodemask.h>
+#include <linux/debugfs.h>
 
 #include "lunix.h"
 #include "lunix-chrdev.h"
@@ -20,8 +23,24 @@
  * Global state for Lunix:TNG sensors
  */
 int lunix_sensor_cnt = LUNIX_SENSOR_CNT;
-struct lunix_sensor_struct *lunix_sensors;
-struct lunix_protocol_state_struct lunix_protocol_state;
+int lunix_sensor_node = NUMA_NO_NODE;
+struct lunix_sensor_struct **lunix_sensors;
+int lunix_ldisc_max = LUNIX_LDISC_MAX;
+int lunix_crc_check = 1;
+int lunix_window_ms = LUNIX_WINDOW_MS;
+struct dentry *lunix_debugfs;
+
+/*
+ * Sensors come from a cache of their own,
+ * so that each one starts on a fresh cache line
+ */
+static struct kmem_cache *lunix_sensor_cache;
+
+static void lunix_sensor_free(struct lunix_sensor_struct *s)
+{
+	lunix_sensor_destroy(s);
+	kmem_cache_free(lunix_sensor_cache, s);
+}
 
 /*
  * Module init and cleanup functions
@@ -31,17 +50,42 @@ static int __init lunix_module_init(void)
 {
 	int ret;
 	int si_done;
+	struct lunix_sensor_struct *s;
 
 	printk(KERN_INFO "Initializing the Lunix:TNG module [max %d sensors]\n",
 		lunix_sensor_cnt);
 
+	ret = -EINVAL;
+	if (lunix_sensor_cnt <= 0 || lunix_sensor_cnt > LUNIX_SENSOR_MAX) {
+		printk(KERN_ERR "Lunix sensor count must be in [1, %d]\n",
+			LUNIX_SENSOR_MAX);
+		goto out;
+	}
+	if (lunix_sensor_node != NUMA_NO_NODE &&
+	    (lunix_sensor_node < 0 || lunix_sensor_node >= MAX_NUMNODES ||
+	     !node_online(lunix_sensor_node))) {
+		printk(KERN_ERR "NUMA node %d is not online\n", lunix_sensor_node);
+		goto out;
+	}
+	if (lunix_window_ms <= 0 || lunix_window_ms > LUNIX_WINDOW_MAX_MS) {
+		printk(KERN_ERR "Lunix aggregation window must be in [1, %d] ms\n",
+			LUNIX_WINDOW_MAX_MS);
+		goto out;
+	}
+
 	ret = -ENOMEM;
-	lunix_sensors = kzalloc(sizeof(*lunix_sensors) * lunix_sensor_cnt, GFP_KERNEL);
+	lunix_sensor_cache = kmem_cache_create("lunix_sensor",
+		sizeof(struct lunix_sensor_struct), 0, SLAB_HWCACHE_ALIGN, NULL);
+	if (!lunix_sensor_cache) {
+		printk(KERN_ERR "Failed to create the Lunix sensor cache\n");
+		goto out;
+	}
+	lunix_sensors = kcalloc(lunix_sensor_cnt, sizeof(*lunix_sensors), GFP_KERNEL);
 	if (!lunix_sensors) {
 		printk(KERN_ERR "Failed to allocate memory for Lunix sensors\n");
-		goto out;
+		goto out_with_cache;
 	}
-	lunix_protocol_init(&lunix_protocol_state);
+	lunix_debugfs = debugfs_create_dir("lunix", NULL);
 
 	/*
 	 * Initialize all sensors. On exit, si_done is the index of the last
@@ -49,11 +93,19 @@ static int __init lunix_module_init(void)
 	 */
 	for (si_done = -1; si_done < lunix_sensor_cnt - 1; si_done++) {
 		debug("initializing sensor %d\n", si_done + 1);
-		ret = lunix_sensor_init(&lunix_sensors[si_done + 1]);
+		s = kmem_cache_alloc_node(lunix_sensor_cache, GFP_KERNEL | __GFP_ZERO,
+		                          lunix_sensor_node);
+		if (!s) {
+			ret = -ENOMEM;
+			goto out_with_sensors;
+		}
+		ret = lunix_sensor_init(s, si_done + 1);
 		debug("initialized sensor %d, ret = %d\n", si_done + 1, ret);
 		if (ret < 0) {
+			lunix_sensor_free(s);
 			goto out_with_sensors;
 		}
+		lunix_sensors[si_done + 1] = s;
 	}
 
 	/*
@@ -81,8 +133,12 @@ out_with_ldisc:
 out_with_sensors:
 	debug("at out_with_sensors\n");
 	for (; si_done >= 0; si_done--)
-		lunix_sensor_destroy(&lunix_sensors[si_done]);
+		lunix_sensor_free(lunix_sensors[si_done]);
 	kfree(lunix_sensors);
+	debugfs_remove_recursive(lunix_debugfs);
+
+out_with_cache:
+	kmem_cache_destroy(lunix_sensor_cache);
 
 out:
 	debug("at out\n");
@@ -99,8 +155,10 @@ static void __exit lunix_module_cleanup(void)
 	
 	debug("destroying sensor buffers\n");
 	for (si_done = lunix_sensor_cnt - 1; si_done >= 0; si_done--)
-		lunix_sensor_destroy(&lunix_sensors[si_done]);
+		lunix_sensor_free(lunix_sensors[si_done]);
 	kfree(lunix_sensors);
+	debugfs_remove_recursive(lunix_debugfs);
+	kmem_cache_destroy(lunix_sensor_cache);
 
 	printk(KERN_INFO "Lunix:TNG module unloaded successfully\n");
 }
@@ -115,6 +173,14 @@ MODULE_LICENSE("GPL");
 
 module_param(lunix_sensor_cnt, int, 0);
 MODULE_PARM_DESC(lunix_sensor_cnt, "Maximum number of sensors to support");
+module_param(lunix_sensor_node, int, 0);
+MODULE_PARM_DESC(lunix_sensor_node, "NUMA node to allocate sensor buffers on [default: any]");
+module_param(lunix_ldisc_max, int, 0);
+MODULE_PARM_DESC(lunix_ldisc_max, "Maximum number of TTYs to attach to [default: 8]");
+module_param(lunix_crc_check, int, 0644);
+MODULE_PARM_DESC(lunix_crc_check, "Drop XMesh packets with a bad CRC [default: 1]");
+module_param(lunix_window_ms, int, 0);
+MODULE_PARM_DESC(lunix_window_ms, "Initial length of the aggregation windows, in ms [default: 1000]");
 
 module_init(lunix_module_init);
 module_exit(lunix_module_cleanup);
@@ -14,10 +14,15 @@
  *
  */
 
+#include <linux/slab.h>
+#include <linux/bitmap.h>
 #include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/debugfs.h>
 #include <asm/byteorder.h>
 
 #include "lunix.h"
+#include "lunix-chrdev.h"
 #include "lunix-protocol.h"
 
 /*
@@ -51,19 +56,20 @@ static inline void lunix_protocol_show_packet(
 }
 
 /*
- * Receives a complete XMesh packet and updates the node structures if
- * the packet contains sensor information. The function ignores other
- * types of packets. In future releases check packets with packet[4]
- * equal to 0x03, 0xFD for extending this function.
+ * Receives a complete XMesh packet and queues an update of the node
+ * structures if the packet contains sensor information. The function
+ * ignores other types of packets. In future releases check packets with
+ * packet[4] equal to 0x03, 0xFD for extending this function.
  */
 static void lunix_protocol_update_sensors(
-         struct lunix_protocol_state_struct *state,
-         struct lunix_sensor_struct *lunix_sensors)
+         struct lunix_protocol_state_struct *state)
 {
 	uint16_t batt;
 	uint16_t temp;
 	uint16_t light;
 	uint16_t nodeid;
+	unsigned int sensor;
+	struct lunix_protocol_update update;
 
 	if (0x0B == state->packet[PACKET_SIGNATURE_OFFSET])
 	{
@@ -77,14 +83,116 @@ static void lunix_protocol_update_sensors(
 		       "{ batt, temp, light } = { 0x%04x, 0x%04x, 0x%04x }\n",
 		       nodeid, batt, temp, light);
 
-		if (nodeid > 0 && nodeid <= lunix_sensor_cnt)
-			lunix_sensor_update(&lunix_sensors[nodeid - 1], batt, temp, light);
-		else
-			printk(KERN_WARNING "Node id %d is out of bounds [maximum %d sensors]\n",
-			                    nodeid, lunix_sensor_cnt);
+		/* Node ids start at 1, within the namespace of this TTY */
+		sensor = READ_ONCE(state->sensor_base) + nodeid - 1;
+		if (nodeid > 0 && sensor < lunix_sensor_cnt) {
+			update.sensor = sensor;
+			update.batt = batt;
+			update.temp = temp;
+			update.light = light;
+			if (!kfifo_put(&state->queue, update))
+				state->stats.queue_full++;
+			queue_work(system_highpri_wq, &state->work);
+		} else {
+			state->stats.bad_nodeid++;
+			printk_ratelimited(KERN_WARNING "Node id %d is out of bounds [base %u, maximum %d sensors]\n",
+			                   nodeid, state->sensor_base, lunix_sensor_cnt);
+		}
 	}
 }
 
+/*
+ * Applies the queued sensor updates, then wakes up the readers of
+ * every sensor touched, once, however many packets it received.
+ */
+static void lunix_protocol_work(struct work_struct *work)
+{
+	struct lunix_protocol_state_struct *state =
+		container_of(work, struct lunix_protocol_state_struct, work);
+	struct lunix_protocol_update update;
+	unsigned int n, sensor;
+
+	/* Take what is there now, updates arriving meanwhile requeue us */
+	n = kfifo_len(&state->queue);
+	while (n-- && kfifo_get(&state->queue, &update)) {
+		lunix_sensor_update(lunix_sensors[update.sensor],
+		                    update.batt, update.temp, update.light);
+		__set_bit(update.sensor, state->dirty);
+	}
+
+	for_each_set_bit(sensor, state->dirty, lunix_sensor_cnt) {
+		__clear_bit(sensor, state->dirty);
+		lunix_sensor_wake(lunix_sensors[sensor]);
+	}
+	lunix_chrdev_all_wake();
+
+	state->stats.batches++;
+}
+
+/*
+ * CRC-16 of XMesh packets, as in the TinyOS serial framer:
+ * CCITT polynomial 0x1021, MSB first, initial value 0.
+ * One table lookup per byte. lunix-gen computes the same
+ * table from LUNIX_PROTOCOL_CRC_POLY when it starts.
+ */
+static const uint16_t lunix_protocol_crc_table[256] = {
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+	0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+	0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+	0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+	0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+	0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+	0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+	0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+	0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+	0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+	0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+	0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+	0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+	0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+	0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+	0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+	0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+	0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+	0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+	0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+	0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+	0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+	0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+	0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+	0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+	0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+	0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+	0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+	0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+	0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+	0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+	0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0
+};
+
+static uint16_t lunix_protocol_crc(const unsigned char *p, int len)
+{
+	uint16_t crc = 0;
+
+	while (len--)
+		crc = (crc << 8) ^ lunix_protocol_crc_table[(crc >> 8) ^ *p++];
+
+	return crc;
+}
+
+/*
+ * Checks the CRC of a complete packet. It covers everything from the
+ * packet type to the end of the payload and is sent little-endian,
+ * just before the end byte.
+ */
+static int lunix_protocol_crc_ok(struct lunix_protocol_state_struct *state)
+{
+	int crc_pos = state->pos - 3;
+
+	return lunix_protocol_crc(&state->packet[1], crc_pos - 1) ==
+	       uint16_from_packet(&state->packet[crc_pos]);
+}
+
 /******************************************************************************
  *                     ----- PACKET STRUCTURE -----
  ******************************************************************************
@@ -100,6 +208,26 @@ static void lunix_protocol_update_sensors(
  * (7 + PL + 2)           0X7E    Packet End byte signature
  ******************************************************************************/
 
+/*
+ * Fields of an XMesh packet, in the order they are received. The
+ * payload is as long as the payload length field says. All fields
+ * between the packet type and the end byte may contain escaped bytes.
+ */
+static const struct {
+	int bytes_to_read;
+	int use_specials;
+} lunix_protocol_fields[] = {
+	[SEEKING_START_BYTE]          = { 1, 0 },
+	[SEEKING_PACKET_TYPE]         = { 1, 0 },
+	[SEEKING_DESTINATION_ADDRESS] = { 2, 1 },
+	[SEEKING_AM_TYPE]             = { 1, 1 },
+	[SEEKING_AM_GROUP]            = { 1, 1 },
+	[SEEKING_PAYLOAD_LENGTH]      = { 1, 1 },
+	[SEEKING_PAYLOAD]             = { 0, 1 },
+	[SEEKING_CRC]                 = { 2, 1 },
+	[SEEKING_END_BYTE]            = { 1, 0 }
+};
+
 /*
  * Helper function to quickly set the current state
  */
@@ -121,6 +249,81 @@ void lunix_protocol_init(struct lunix_protocol_state_struct *state)
 	set_state(state, SEEKING_START_BYTE, 1, 0);
 }
 
+/*
+ * Setup and teardown of the protocol state machine of a TTY
+ */
+int lunix_protocol_create(struct lunix_protocol_state_struct *state)
+{
+	state->dirty = bitmap_zalloc(lunix_sensor_cnt, GFP_KERNEL);
+	if (!state->dirty)
+		return -ENOMEM;
+
+	INIT_KFIFO(state->queue);
+	INIT_WORK(&state->work, lunix_protocol_work);
+	lunix_protocol_init(state);
+	return 0;
+}
+
+void lunix_protocol_destroy(struct lunix_protocol_state_struct *state)
+{
+	/* Nothing more is coming from the TTY, apply what is left */
+	flush_work(&state->work);
+	bitmap_free(state->dirty);
+}
+
+/*
+ * Export the link quality counters of a protocol state machine
+ * under <debugfs>/lunix/<name>/
+ */
+void lunix_protocol_debugfs_init(struct lunix_protocol_state_struct *state,
+                                 const char *name)
+{
+	state->debugfs = debugfs_create_dir(name, lunix_debugfs);
+	debugfs_create_ulong("frames_ok", 0444, state->debugfs, &state->stats.frames_ok);
+	debugfs_create_ulong("crc_errors", 0444, state->debugfs, &state->stats.crc_errors);
+	debugfs_create_ulong("overflows", 0444, state->debugfs, &state->stats.overflows);
+	debugfs_create_ulong("bad_nodeid", 0444, state->debugfs, &state->stats.bad_nodeid);
+	debugfs_create_ulong("queue_full", 0444, state->debugfs, &state->stats.queue_full);
+	debugfs_create_ulong("batches", 0444, state->debugfs, &state->stats.batches);
+}
+
+void lunix_protocol_debugfs_destroy(struct lunix_protocol_state_struct *state)
+{
+	debugfs_remove_recursive(state->debugfs);
+	state->debugfs = NULL;
+}
+
+/*
+ * Is any byte of a word zero?
+ */
+static inline int lunix_protocol_has_zero(unsigned long w)
+{
+	return ((w - REPEAT_BYTE(0x01)) & ~w & REPEAT_BYTE(0x80)) != 0;
+}
+
+/*
+ * Returns the number of leading bytes in data[0, length)
+ * which are neither 0x7E nor 0x7D, looking at a whole word
+ * at a time while there are no special characters in sight.
+ */
+static int lunix_protocol_plain_run(const unsigned char *data, int length)
+{
+	unsigned long w;
+	int n = 0;
+
+	while (n + (int)sizeof(w) <= length) {
+		memcpy(&w, data + n, sizeof(w));
+		if (lunix_protocol_has_zero(w ^ REPEAT_BYTE(0x7E)) ||
+		    lunix_protocol_has_zero(w ^ REPEAT_BYTE(0x7D)))
+			break;
+		n += sizeof(w);
+	}
+	while (n < length && data[n] != 0x7E && data[n] != 0x7D)
+		n++;
+
+	return n;
+}
+
 /*
  * Crucial function for parsing the input packet according
  * to the current state.
@@ -131,65 +334,54 @@ void lunix_protocol_init(struct lunix_protocol_state_struct *state)
  * int *i: the pointer to the data received is updated when data are 
  *         transferred to the unparsed_packet array
  * int use_specials: if 1 special characters are treated acc
+ *
+ * Runs of ordinary bytes are copied in bulk, only special
+ * characters are handled one byte at a time.
  */
 static int lunix_protocol_parse_state(struct lunix_protocol_state_struct *state,
                                       const unsigned char *data, int length,
                                       int *i, int use_specials)
 {
-	int iter;
+	int n;
 
-	iter = 0;
 	while ((*i < length) && (state->bytes_read < state->bytes_to_read))
 	{
-#if LUNIX_DEBUG
-		if (++iter == 50) {
-			debug("OOPS!\n");
-			return -1;
-		}
-#endif
 		/* Prevent buffer overflows */
 		if (state->pos == MAX_PACKET_LEN) {
-			printk(KERN_ERR "WARNING: state->pos == %d, MAX_PACKET_LEN is %d,"
-			       "packet buffer would overflow!\n", state->pos, MAX_PACKET_LEN);
-			printk(KERN_ERR "How will I ever resync with the input stream?\n");
-			state->pos = 0;
+			state->stats.overflows++;
+			printk_ratelimited(KERN_ERR "WARNING: state->pos == %d, MAX_PACKET_LEN is %d,"
+			                   "packet buffer would overflow!\n", state->pos, MAX_PACKET_LEN);
 			return -1;
 		}
 
-		if (1 == use_specials)
-		{
-			if (state->next_is_special)
-			{
-				if (0x7E == state->next_is_special)
-					state->packet[state->pos] = data[*i];
-				if (0x7D == state->next_is_special)
-					state->packet[state->pos] = data[*i]^0x20;
-				++state->pos;
-				++state->bytes_read;
-				++(*i);
-				state->next_is_special = 0;
-			}
-			else
-			{
-				if ((0x7E == data[*i]) || (0x7D == data[*i]))
-				{
-					state->next_is_special = data[*i];
-					++(*i);
-				} else {
-					state->packet[state->pos] = data[*i];
-					++state->pos;
-					++state->bytes_read;
-					++(*i);
-				}
-			}
-		}
-		else
+		if (use_specials && state->next_is_special)
 		{
-			state->packet[state->pos] = data[*i];
+			if (0x7E == state->next_is_special)
+				state->packet[state->pos] = data[*i];
+			if (0x7D == state->next_is_special)
+				state->packet[state->pos] = data[*i]^0x20;
 			++state->pos;
 			++state->bytes_read;
 			++(*i);
+			state->next_is_special = 0;
+			continue;
+		}
+
+		n = min3(length - *i, state->bytes_to_read - state->bytes_read,
+		         MAX_PACKET_LEN - state->pos);
+		if (use_specials) {
+			n = lunix_protocol_plain_run(&data[*i], n);
+			if (n == 0) {
+				state->next_is_special = data[*i];
+				++(*i);
+				continue;
+			}
 		}
+
+		memcpy(&state->packet[state->pos], &data[*i], n);
+		state->pos += n;
+		state->bytes_read += n;
+		*i += n;
 	}
 
 	if (state->bytes_read == state->bytes_to_read) {
@@ -199,6 +391,34 @@ static int lunix_protocol_parse_state(struct lunix_protocol_state_struct *state,
 	return 0;
 }
 
+/*
+ * Moves on to the next field, once the current one has been received
+ */
+static void lunix_protocol_next_state(struct lunix_protocol_state_struct *state)
+{
+	int next;
+
+	if (state->state == SEEKING_END_BYTE) {
+		if (lunix_crc_check && !lunix_protocol_crc_ok(state)) {
+			debug("A complete XMesh packet has been received, bad CRC, dropping it\n");
+			state->stats.crc_errors++;
+		} else {
+			debug("A complete XMesh packet has been received, updating sensors\n");
+			state->stats.frames_ok++;
+			lunix_protocol_update_sensors(state);
+		}
+		lunix_protocol_init(state);
+		return;
+	}
+
+	next = state->state + 1;
+	if (next == SEEKING_PAYLOAD) {
+		state->payload_length = state->packet[state->pos - 1];
+		set_state(state, next, state->payload_length, 0);
+	} else
+		set_state(state, next, lunix_protocol_fields[next].bytes_to_read, 0);
+}
+
 /*
  * This function gets called for incoming data
  * to update the protocol state machine.
@@ -207,54 +427,32 @@ int lunix_protocol_received_buf(struct lunix_protocol_state_struct *state,
                                 const unsigned char *buf, int length)
 {
 	int i;
-	int payload_length;
+	int ret;
+	const unsigned char *start;
 
 	i = 0;
 
-	if (state->state == SEEKING_START_BYTE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1)
-			set_state(state, SEEKING_PACKET_TYPE, 1, 0);
-
-
-	if (state->state == SEEKING_PACKET_TYPE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1)
-			set_state(state, SEEKING_DESTINATION_ADDRESS, 2, 0);
-
-	if (state->state == SEEKING_DESTINATION_ADDRESS) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_AM_TYPE, 1, 0);
-
-	if (state->state == SEEKING_AM_TYPE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_AM_GROUP, 1, 0);
-
-	if (state->state == SEEKING_AM_GROUP) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_PAYLOAD_LENGTH, 1, 0);
-
-	if (state->state == SEEKING_PAYLOAD_LENGTH) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1) {
-			payload_length = state->packet[state->pos - 1];
-			set_state(state, SEEKING_PAYLOAD, payload_length, 0);
+	while (i < length) {
+		/*
+		 * Between packets, skip straight to the next start byte
+		 */
+		if (state->state == SEEKING_START_BYTE) {
+			start = memchr(&buf[i], 0x7E, length - i);
+			if (!start)
+				break;
+			i = start - buf;
 		}
 
-	if (state->state == SEEKING_PAYLOAD) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_CRC, 2, 0);
-
-	if (state->state == SEEKING_CRC) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_END_BYTE, 1, 0);
-
-	if (state->state == SEEKING_END_BYTE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1) {
-			debug("A complete XMesh packet has been received, updating sensors\n");
-
-			lunix_protocol_update_sensors(state, lunix_sensors);
-			state->pos = 0;
-			state->next_is_special = 0;
-			set_state(state, SEEKING_START_BYTE, 1, 0);
+		ret = lunix_protocol_parse_state(state, buf, length, &i,
+		          lunix_protocol_fields[state->state].use_specials);
+		if (ret < 0) {
+			/* Drop the packet, resync on the next start byte */
+			lunix_protocol_init(state);
+			continue;
 		}
+		if (ret == 1)
+			lunix_protocol_next_state(state);
+	}
 
 	return 0;
 }
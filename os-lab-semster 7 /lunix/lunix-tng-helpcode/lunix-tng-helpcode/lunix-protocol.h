@@ -13,10 +13,9 @@
 #ifndef _LUNIX_PROTOCOL_H
 #define _LUNIX_PROTOCOL_H
 
-#ifdef __KERNEL__ 
-
 /*
- * Application/Protocol specific constants
+ * Application/Protocol specific constants,
+ * shared with the userspace traffic generator
  */
 #define MAX_PACKET_LEN 300
 #define PACKET_SIGNATURE_OFFSET 4
@@ -24,6 +23,14 @@
 #define VREF_OFFSET 18
 #define TEMPERATURE_OFFSET 20
 #define LIGHT_OFFSET 22
+#define LUNIX_PROTOCOL_CRC_POLY 0x1021 /* CRC-16/CCITT, MSB first, initial value 0 */
+
+#ifdef __KERNEL__ 
+
+#include <linux/kfifo.h>
+#include <linux/workqueue.h>
+
+#define LUNIX_PROTOCOL_QUEUE 1024 /* Sensor updates queued per TTY, a power of 2 */
 
 /*
  * States of the Lunix protocol state machine
@@ -38,6 +45,31 @@
 #define SEEKING_CRC                    8
 #define SEEKING_END_BYTE               9
 
+/*
+ * Link quality counters, exported through debugfs
+ */
+struct lunix_protocol_stats
+{
+	unsigned long frames_ok;        /* Packets with a valid CRC */
+	unsigned long crc_errors;       /* Packets dropped for a bad CRC */
+	unsigned long overflows;        /* Packets longer than MAX_PACKET_LEN */
+	unsigned long bad_nodeid;       /* Sensor packets from unknown nodes */
+	unsigned long queue_full;       /* Packets dropped, processing fell behind */
+	unsigned long batches;          /* Runs of the processing work */
+};
+
+/*
+ * The measurements of a packet, on their way from
+ * the TTY receive path to the sensor buffers
+ */
+struct lunix_protocol_update
+{
+	uint32_t sensor;
+	uint16_t batt;
+	uint16_t temp;
+	uint16_t light;
+};
+
 /*
  * Current state of the Lunix protocol state machine
  */
@@ -51,12 +83,37 @@ struct lunix_protocol_state_struct
 	unsigned char next_is_special;  /* The next character to be received is a special character */
 	unsigned char payload_length;   /* The length of the payload of the received packet */
 	unsigned char packet[MAX_PACKET_LEN]; /* The XMesh packet being received */
+
+	unsigned int sensor_base;       /* Sensor updated by node id 1 */
+
+	/*
+	 * Packets are parsed as they arrive, but the sensors are updated
+	 * in batches by a work item, with one wakeup per sensor per batch.
+	 * The TTY is the only producer and the work the only consumer.
+	 */
+	DECLARE_KFIFO(queue, struct lunix_protocol_update, LUNIX_PROTOCOL_QUEUE);
+	struct work_struct work;
+	unsigned long *dirty;           /* Sensors updated in this batch */
+
+	struct lunix_protocol_stats stats;
+	struct dentry *debugfs;         /* Directory holding the stats */
 };
 
+/*
+ * Module parameters and debugfs root
+ */
+extern int lunix_crc_check;
+extern struct dentry *lunix_debugfs;
+
 /*
  * Function prototypes
  */
 void lunix_protocol_init(struct lunix_protocol_state_struct *);
+int lunix_protocol_create(struct lunix_protocol_state_struct *);
+void lunix_protocol_destroy(struct lunix_protocol_state_struct *);
+void lunix_protocol_debugfs_init(struct lunix_protocol_state_struct *,
+                                 const char *name);
+void lunix_protocol_debugfs_destroy(struct lunix_protocol_state_struct *);
 int lunix_protocol_received_buf(struct lunix_protocol_state_struct *,
                                 const unsigned char *buf, int count);
 
@@ -17,6 +17,7 @@
 #include <linux/sched.h>
 #include <linux/ioctl.h>
 #include <linux/types.h>
+#include <linux/math64.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/mmzone.h>
@@ -24,36 +25,43 @@
 #include <linux/spinlock.h>
 
 #include "lunix.h"
+#include "lunix-chrdev.h"
+#include "lunix-lookup.h"
 
 /*
  * Initialization and destruction of sensor structures
  */
-int lunix_sensor_init(struct lunix_sensor_struct *s)
+int lunix_sensor_init(struct lunix_sensor_struct *s, unsigned int id)
 {
 	int i;
 	int ret;
-	unsigned long p;
+	struct page *p;
 
 	/*
 	 * Initialize structure fields
 	 */
+	s->id = id;
 	spin_lock_init(&s->lock);
 	init_waitqueue_head(&s->wq);
+	for (i = 0; i < N_LUNIX_MSR; i++)
+		s->aggr[i].window_ns = (uint64_t)lunix_window_ms * NSEC_PER_MSEC;
 
 	/*
-	 * Allocate one page per measurement buffer
+	 * Allocate one page per measurement buffer,
+	 * on the requested NUMA node if any
 	 */
 	for (i = 0; i < N_LUNIX_MSR; i++)
 		s->msr_data[i] = NULL;
 
 	for (i = 0; i < N_LUNIX_MSR; i++) {
-		p = get_zeroed_page(GFP_KERNEL);
+		p = alloc_pages_node(lunix_sensor_node, GFP_KERNEL | __GFP_ZERO, 0);
 		if (!p) {
 			ret = -ENOMEM;
 			goto out;
 		}
-		s->msr_data[i] = (struct lunix_msr_data_struct *)p;
+		s->msr_data[i] = (struct lunix_msr_data_struct *)page_address(p);
 		s->msr_data[i]->magic = LUNIX_MSR_MAGIC;
+		s->msr_data[i]->ring_len = LUNIX_MSR_RING_LEN;
 	}
 
 	ret = 0;
@@ -71,26 +79,205 @@ void lunix_sensor_destroy(struct lunix_sensor_struct *s)
 	}
 }
 
+/*
+ * Converts a raw measurement to milli-units. Battery and temperature
+ * come from the 10-bit ADC, anything above its full scale is clamped.
+ */
+static long lunix_msr_convert(enum lunix_msr_enum type, uint32_t raw)
+{
+	switch (type) {
+	case BATT:
+		return lookup_voltage[min_t(uint32_t, raw, LUNIX_LOOKUP_SIZE - 1)];
+	case TEMP:
+		return lookup_temperature[min_t(uint32_t, raw, LUNIX_LOOKUP_SIZE - 1)];
+	case LIGHT:
+		return div_u64((u64)min_t(uint32_t, raw, 0xFFFF) * LUNIX_LIGHT_MUL,
+		               LUNIX_LIGHT_DIV);
+	default:
+		WARN_ON(1);
+		return 0;
+	}
+}
+
+/*
+ * Renders a value in milli-units as text, the way
+ * the character device returns it to its readers
+ */
+int lunix_msr_format(char *buf, size_t size, long value)
+{
+	return scnprintf(buf, size, "%ld.%03ld  ", value / 1000, value % 1000);
+}
+
+/*
+ * Append a sample to the ring of a measurement page.
+ * Must be called with the sensor lock held, inside
+ * a seqcount write section of the page.
+ */
+static void lunix_msr_push(struct lunix_msr_data_struct *msr,
+                           uint32_t timestamp, uint64_t timestamp_ns,
+                           uint16_t raw, int32_t value,
+                           const char *text, int text_len)
+{
+	uint32_t *sample = lunix_msr_sample(msr, msr->seq);
+
+	sample[LUNIX_MSR_SAMPLE_TS] = timestamp;
+	sample[LUNIX_MSR_SAMPLE_NS_LO] = lower_32_bits(timestamp_ns);
+	sample[LUNIX_MSR_SAMPLE_NS_HI] = upper_32_bits(timestamp_ns);
+	sample[LUNIX_MSR_SAMPLE_VALUE] = raw;
+	sample[LUNIX_MSR_SAMPLE_CONV] = value;
+	msr->value = value;
+	memcpy(msr->text, text, text_len);
+	msr->text_len = text_len;
+	msr->last_update = timestamp;
+	msr->last_update_ns = timestamp_ns;
+	msr->seq++;
+}
+
+/*
+ * Adds a sample to the aggregates of a measurement, moving on to a
+ * new window if the current one has ended. Must be called with the
+ * sensor lock held.
+ */
+static void lunix_msr_aggr_add(struct lunix_msr_aggr *aggr,
+                               uint64_t timestamp_ns, int32_t value)
+{
+	struct lunix_msr_window *w = &aggr->cur;
+
+	if (w->count && timestamp_ns - w->start_ns >= aggr->window_ns) {
+		aggr->last = *w;
+		w->count = 0;
+	}
+
+	if (!w->count) {
+		w->start_ns = timestamp_ns;
+		w->min = w->max = value;
+		w->sum = 0;
+	}
+	w->count++;
+	w->min = min(w->min, value);
+	w->max = max(w->max, value);
+	w->sum += value;
+}
+
+static void lunix_msr_window_get(const struct lunix_msr_window *w,
+                                 struct lunix_aggr_window *out)
+{
+	out->start_ns = w->start_ns;
+	out->count = w->count;
+	out->min = w->count ? w->min : 0;
+	out->max = w->count ? w->max : 0;
+	out->mean = w->count ? div_s64(w->sum, w->count) : 0;
+}
+
+/*
+ * Copies out the aggregates of a measurement, in O(1).
+ * A window which has ended with no sample since is reported
+ * as the last complete one.
+ */
+void lunix_sensor_aggr_get(struct lunix_sensor_struct *s,
+                           enum lunix_msr_enum type, struct lunix_aggr *out)
+{
+	struct lunix_msr_aggr *aggr = &s->aggr[type];
+	struct lunix_msr_window cur, last;
+	uint64_t window_ns, now_ns = ktime_get_ns();
+
+	spin_lock(&s->lock);
+	window_ns = aggr->window_ns;
+	cur = aggr->cur;
+	last = aggr->last;
+	spin_unlock(&s->lock);
+
+	if (cur.count && now_ns - cur.start_ns >= window_ns) {
+		last = cur;
+		cur.count = 0;
+	}
+
+	out->window_ms = div_u64(window_ns, NSEC_PER_MSEC);
+	out->reserved = 0;
+	lunix_msr_window_get(&cur, &out->cur);
+	lunix_msr_window_get(&last, &out->last);
+}
+
+/*
+ * Changes the window length of a measurement, dropping its aggregates
+ */
+void lunix_sensor_aggr_set(struct lunix_sensor_struct *s,
+                           enum lunix_msr_enum type, uint32_t window_ms)
+{
+	struct lunix_msr_aggr *aggr = &s->aggr[type];
+
+	spin_lock(&s->lock);
+	memset(aggr, 0, sizeof(*aggr));
+	aggr->window_ns = (uint64_t)window_ms * NSEC_PER_MSEC;
+	spin_unlock(&s->lock);
+}
+
+/*
+ * Stores the measurements of a packet. Does not wake anyone up,
+ * callers do so with lunix_sensor_wake() once they are done with
+ * a whole batch of packets.
+ */
 void lunix_sensor_update(struct lunix_sensor_struct *s,
                          uint16_t batt, uint16_t temp, uint16_t light)
 {
+	int i;
+	uint32_t now = ktime_get_real_seconds();
+	uint64_t now_ns = ktime_get_ns();
+	uint16_t raw[N_LUNIX_MSR] = { [BATT] = batt, [TEMP] = temp, [LIGHT] = light };
+	int32_t value[N_LUNIX_MSR];
+	char text[N_LUNIX_MSR][LUNIX_MSR_TEXT_LEN];
+	int text_len[N_LUNIX_MSR];
+
+	/*
+	 * Convert and render the measurements once, here,
+	 * instead of in every reader, and outside the lock.
+	 */
+	for (i = 0; i < N_LUNIX_MSR; i++) {
+		value[i] = lunix_msr_convert(i, raw[i]);
+		text_len[i] = lunix_msr_format(text[i], LUNIX_MSR_TEXT_LEN, value[i]);
+	}
+
 	spin_lock(&s->lock);
 
 	/*
-	 * Update the raw values and the relevant timestamps.
+	 * Open the write sections of all pages before touching any,
+	 * so that a reader checking all three seqcounts sees the
+	 * measurements of a single packet.
 	 */
-	s->msr_data[BATT]->values[0] = batt;
-	s->msr_data[TEMP]->values[0] = temp;
-	s->msr_data[LIGHT]->values[0] = light;
+	for (i = 0; i < N_LUNIX_MSR; i++)
+		lunix_msr_write_begin(s->msr_data[i]);
+
+	/*
+	 * Append the raw and converted values and the relevant
+	 * timestamps to the sample ring of each measurement.
+	 */
+	for (i = 0; i < N_LUNIX_MSR; i++)
+		lunix_msr_push(s->msr_data[i], now, now_ns, raw[i], value[i],
+		               text[i], text_len[i]);
+
+	for (i = 0; i < N_LUNIX_MSR; i++)
+		lunix_msr_write_end(s->msr_data[i]);
 
-	s->msr_data[BATT]->magic = s->msr_data[TEMP]->magic = s->msr_data[LIGHT]->magic = LUNIX_MSR_MAGIC;
-	s->msr_data[BATT]->last_update = s->msr_data[TEMP]->last_update = s->msr_data[LIGHT]->last_update = ktime_get_real_seconds();
+	/*
+	 * Keep the aggregates up to date as we go,
+	 * so that they cost O(1) to fetch
+	 */
+	for (i = 0; i < N_LUNIX_MSR; i++)
+		lunix_msr_aggr_add(&s->aggr[i], now_ns, value[i]);
 
 	spin_unlock(&s->lock);
 
 	/*
-	 * And wake up any sleepers who may be waiting on
-	 * fresh data from this sensor.
+	 * Feed the merged stream of the "all sensors" node
+	 */
+	lunix_chrdev_all_publish(s->id, now, now_ns, raw, value);
+}
+
+void lunix_sensor_wake(struct lunix_sensor_struct *s)
+{
+	/*
+	 * Wake up any sleepers who may be waiting on
+	 * fresh data from this sensor, or polling it.
 	 */
-	wake_up_interruptible(&s->wq);
+	wake_up_interruptible_poll(&s->wq, EPOLLIN | EPOLLRDNORM);
 }
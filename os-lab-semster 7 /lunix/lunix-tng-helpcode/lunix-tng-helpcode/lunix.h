@@ -13,6 +13,13 @@
 /* Compile-time parameters */
 #define LUNIX_VERSION_STRING "0.1701-D"
 
+/*
+ * The measurements reported by each sensor, one page each.
+ * The "all sensors" node maps the page of measurement <TYPE>
+ * of sensor <NO> at page offset (NO * N_LUNIX_MSR + TYPE).
+ */
+enum lunix_msr_enum { BATT = 0, TEMP, LIGHT, N_LUNIX_MSR };
+
 #ifdef __KERNEL__ 
 
 #include <linux/fs.h>
@@ -27,8 +34,32 @@
 
 #define LUNIX_MSR_MAGIC 0xF00DF00D
 
-enum lunix_msr_enum { BATT = 0, TEMP, LIGHT, N_LUNIX_MSR };
+/*
+ * Running aggregates of the converted values of a measurement
+ * over a window of time, starting with its first sample
+ */
+struct lunix_msr_window {
+	uint64_t start_ns;
+	uint32_t count;
+	int32_t min;
+	int32_t max;
+	int64_t sum;
+};
+
+/*
+ * Tumbling windows of window_ns nanoseconds: samples are added to cur,
+ * which is moved to last once a sample arrives after it has ended
+ */
+struct lunix_msr_aggr {
+	uint64_t window_ns;
+	struct lunix_msr_window cur;
+	struct lunix_msr_window last;
+};
+
 struct lunix_sensor_struct {
+	/* Index of this sensor, node id - 1 */
+	unsigned int id;
+
 	/*
 	 * A number of pages, one for each measurement.
 	 * They can be mapped to userspace.
@@ -36,25 +67,44 @@ struct lunix_sensor_struct {
 	struct lunix_msr_data_struct *msr_data[N_LUNIX_MSR];
 
 	/*
-	 * Spinlock used to assert mutual exclusion between
-	 * the serial line discipline and the character device driver
+	 * Spinlock used to serialize updates coming from
+	 * the serial line discipline. Readers of the pages never
+	 * take it, they use the seqcount in each page instead.
+	 * It also protects the aggregates.
 	 */
 	spinlock_t lock;
 
+	/* Aggregates over a window of time, one per measurement */
+	struct lunix_msr_aggr aggr[N_LUNIX_MSR];
+
 	/*
 	 * A list of processes waiting to be woken up
 	 * when this sensor has been updated with new data
 	 */
 	wait_queue_head_t wq;
-};
+
+	/*
+	 * Each sensor is allocated on its own, starting on a cache line
+	 * of its own, so that updates to one sensor do not bounce the
+	 * lock and waitqueue of its neighbours between CPUs.
+	 */
+} ____cacheline_aligned_in_smp;
 
 /*
- * The default value for the maximum number of sensors supported
+ * The default value for the maximum number of sensors supported,
+ * and the hard limit imposed by 16-bit node ids.
  */
 #define LUNIX_SENSOR_CNT 16
+#define LUNIX_SENSOR_MAX 65535
 extern int lunix_sensor_cnt;
-extern struct lunix_sensor_struct *lunix_sensors;
-extern struct lunix_protocol_state_struct lunix_protocol_state;
+extern int lunix_sensor_node;
+
+/*
+ * The default length of the aggregation windows, in milliseconds
+ */
+#define LUNIX_WINDOW_MS 1000
+extern int lunix_window_ms;
+extern struct lunix_sensor_struct **lunix_sensors;
 
 /*
  * Debugging
@@ -68,10 +118,17 @@ extern struct lunix_protocol_state_struct lunix_protocol_state;
 /*
  * Function prototypes
  */
-int lunix_sensor_init(struct lunix_sensor_struct *);
+int lunix_sensor_init(struct lunix_sensor_struct *, unsigned int id);
 void lunix_sensor_destroy(struct lunix_sensor_struct *);
 void lunix_sensor_update(struct lunix_sensor_struct *s,
                          uint16_t batt, uint16_t temp, uint16_t light);
+void lunix_sensor_wake(struct lunix_sensor_struct *s);
+int lunix_msr_format(char *buf, size_t size, long value);
+struct lunix_aggr;
+void lunix_sensor_aggr_get(struct lunix_sensor_struct *s,
+                           enum lunix_msr_enum type, struct lunix_aggr *aggr);
+void lunix_sensor_aggr_set(struct lunix_sensor_struct *s,
+                           enum lunix_msr_enum type, uint32_t window_ms);
 
 #else
 #include <inttypes.h>
@@ -80,13 +137,108 @@ void lunix_sensor_update(struct lunix_sensor_struct *s,
  * A structure, living at the start of a page, containing a version number
  * [timestamp of last update] and a variable number of 32-bit quantities. It is
  * meant to be mappable to userspace.
+ *
+ * The 32-bit quantities form a ring of the LUNIX_MSR_RING_LEN most recent
+ * samples, each LUNIX_MSR_SAMPLE_WORDS words long. seq counts the samples
+ * ever written; sample n lives in slot (n % LUNIX_MSR_RING_LEN). There is
+ * a single producer, which fills in a slot before advancing seq. seq is
+ * the generation of the page: it changes with every update, however close
+ * together, so it is what readers use to detect new data.
+ *
+ * last_update is the wall clock time of the latest update, in seconds.
+ * last_update_ns, and the timestamp of each sample, are CLOCK_MONOTONIC
+ * nanoseconds, which tell apart updates within the same second.
+ *
+ * Every update of a page happens between two increments of seqcount, so
+ * seqcount is odd while the page is being written. A reader, either the
+ * character device or an mmap user, samples seqcount (waiting while it is
+ * odd), copies what it needs, and retries if seqcount has changed since.
+ * A reader keeps a cursor (the seq of the next sample it wants) and reads
+ * the samples in [max(cursor, seq - LUNIX_MSR_RING_LEN), seq). The pages
+ * can only be mapped read-only, since the readers in the kernel trust the
+ * seqcount to become even again.
+ *
+ * Measurements are converted to milli-units once, when they are received,
+ * and stored next to the raw value. The most recent one is also kept
+ * in value, and rendered as text in text[0..text_len), so that readers
+ * keeping up with the sensor only need to copy it.
  */
+#define LUNIX_MSR_RING_LEN      128     /* Must be a power of two */
+#define LUNIX_MSR_SAMPLE_WORDS  5
+#define LUNIX_MSR_SAMPLE_TS     0       /* Timestamp of the sample, seconds */
+#define LUNIX_MSR_SAMPLE_VALUE  1       /* Raw 16-bit measurement */
+#define LUNIX_MSR_SAMPLE_CONV   2       /* Signed value, in milli-units */
+#define LUNIX_MSR_SAMPLE_NS_LO  3       /* Monotonic timestamp, nanoseconds */
+#define LUNIX_MSR_SAMPLE_NS_HI  4
+#define LUNIX_MSR_TEXT_LEN      20
+
 struct lunix_msr_data_struct {
 	uint32_t magic;
+	uint32_t seqcount;
 	uint32_t last_update;
+	uint32_t seq;
+	uint64_t last_update_ns;
+	uint32_t ring_len;
+	int32_t value;
+	uint32_t text_len;
+	char text[LUNIX_MSR_TEXT_LEN];
 	uint32_t values[];
 };
 
+/*
+ * Returns the ring slot holding the sample with sequence number seq
+ */
+static inline uint32_t *lunix_msr_sample(struct lunix_msr_data_struct *msr,
+                                         uint32_t seq)
+{
+	return &msr->values[(seq & (LUNIX_MSR_RING_LEN - 1)) *
+	                    LUNIX_MSR_SAMPLE_WORDS];
+}
+
+/*
+ * Returns the monotonic timestamp of a sample, in nanoseconds
+ */
+static inline uint64_t lunix_msr_sample_ns(const uint32_t *sample)
+{
+	return (uint64_t)sample[LUNIX_MSR_SAMPLE_NS_HI] << 32 |
+	       sample[LUNIX_MSR_SAMPLE_NS_LO];
+}
+
+#ifdef __KERNEL__
+/*
+ * Seqcount protocol on a measurement page. Writers must be serialized
+ * by the sensor lock; readers never block the writer.
+ */
+static inline void lunix_msr_write_begin(struct lunix_msr_data_struct *msr)
+{
+	WRITE_ONCE(msr->seqcount, msr->seqcount + 1);
+	smp_wmb();
+}
+
+static inline void lunix_msr_write_end(struct lunix_msr_data_struct *msr)
+{
+	smp_wmb();
+	WRITE_ONCE(msr->seqcount, msr->seqcount + 1);
+}
+
+static inline uint32_t lunix_msr_read_begin(struct lunix_msr_data_struct *msr)
+{
+	uint32_t start;
+
+	while ((start = READ_ONCE(msr->seqcount)) & 1)
+		cpu_relax();
+	smp_rmb();
+	return start;
+}
+
+static inline int lunix_msr_read_retry(struct lunix_msr_data_struct *msr,
+                                       uint32_t start)
+{
+	smp_rmb();
+	return READ_ONCE(msr->seqcount) != start;
+}
+#endif /* __KERNEL__ */
+
 /*
  * Lunix:TNG line discipline number:
  * Hijack the "Mobitex module" line discipline, since the number
@@ -12,3 +12,6 @@ for sensor in $(seq 0 1 15); do
 	mknod /dev/lunix$sensor-temp c 60 $[$sensor * 8 + 1]
 	mknod /dev/lunix$sensor-light c 60 $[$sensor * 8 + 2]
 done
+
+# A single node streaming updates from all sensors: minor 16 * 8
+mknod /dev/lunix-all c 60 128
@@ -2,9 +2,12 @@
  * mk-lunix-lookup.c
  *
  * Computes the temperature and battery
- * lookup tables for converting 16-bit raw measurements
+ * lookup tables for converting raw measurements
  * from the wireless sensors to actual floating point values.
  *
+ * Both come from the 10-bit ADC of the sensor, so the tables
+ * only cover [0, LUNIX_ADC_FS]; light is linear and needs no table.
+ *
  * Ioannis Panagopoulos <ioannis@cslab.ece.ntua.gr>
  * Vangelis Koukis <vkoukis@cslab.ece.ntua.gr>
  *
@@ -14,6 +17,8 @@
 #include <stdio.h>
 #include <inttypes.h>
 
+#define LUNIX_ADC_FS 1023
+
 /*
  * Translates the received uint16_t value to voltage level
  */
@@ -72,49 +77,44 @@ int main(void)
 
 	fprintf(stdout,
 	        "/*\n"
-	        " * lunix-tables.h\n"
+	        " * lunix-lookup.h\n"
 	        " *\n"
 	        " * Machine-generated file. DO NOT EDIT.\n"
 	        " * See %s instead.\n"
 	        " *\n"
 	        " * Instead of doing floating-point in kernelspace,\n"
-	        " * use the following lookup tables to convert 16-bit\n"
-	        " * raw measurements to floating point values.\n"
+	        " * use the following lookup tables to convert 10-bit\n"
+	        " * raw measurements to fixed point [milli-unit] values.\n"
+	        " * Light is linear, see LUNIX_LIGHT_MUL / LUNIX_LIGHT_DIV.\n"
 	        " */\n"
 	        "\n"
-	        "long lookup_temperature[65536] = {\n", __FILE__);
+	        "#define LUNIX_LOOKUP_SIZE %d\n"
+	        "#define LUNIX_LIGHT_MUL 5000000\n"
+	        "#define LUNIX_LIGHT_DIV 65535\n"
+	        "\n"
+	        "static const int32_t lookup_temperature[LUNIX_LOOKUP_SIZE] = {\n",
+	        __FILE__, LUNIX_ADC_FS + 1);
 
 	/*
 	 * Temperature
 	 */
-	for (i = 0; i <= 0xFFFC; i += 4) {
+	for (i = 0; i <= LUNIX_ADC_FS - 3; i += 4) {
 		fprintf(stdout, "\t%ld, %ld, %ld, %ld",
 		        uint16_to_temp(i), uint16_to_temp(i+1),
 		        uint16_to_temp(i+2), uint16_to_temp(i+3));
-		fprintf(stdout, (i != 0xFFFC) ? ",\n" : "\n");
+		fprintf(stdout, (i != LUNIX_ADC_FS - 3) ? ",\n" : "\n");
 	}
 
-	fprintf(stdout, "};\n\nlong lookup_voltage[65536] = {\n");
+	fprintf(stdout, "};\n\nstatic const int32_t lookup_voltage[LUNIX_LOOKUP_SIZE] = {\n");
 
 	/*
 	 * Battery Voltage
 	 */
-	for (i = 0; i <= 0xFFFC; i += 4) {
+	for (i = 0; i <= LUNIX_ADC_FS - 3; i += 4) {
 		fprintf(stdout, "\t%ld, %ld, %ld, %ld",
 			uint16_to_batt(i), uint16_to_batt(i+1),
 			uint16_to_batt(i+2), uint16_to_batt(i+3));
-		fprintf(stdout, (i != 0xFFFC) ? ",\n" : "\n");
-	}
-	fprintf(stdout, "};\n\nlong lookup_light[65536] = {\n");
-
-	/*
-	 * Light
-	 */
-	for (i = 0; i <= 0xFFFC; i += 4) {
-		fprintf(stdout, "\t%ld, %ld, %ld, %ld",
-		        uint16_to_light(i), uint16_to_light(i+1),
-		        uint16_to_light(i+2), uint16_to_light(i+3));
-		fprintf(stdout, (i != 0xFFFC) ? ",\n" : "\n");
+		fprintf(stdout, (i != LUNIX_ADC_FS - 3) ? ",\n" : "\n");
 	}
 
 	fprintf(stdout, "};\n\n");